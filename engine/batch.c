@@ -0,0 +1,182 @@
+/**
+ * A batch of runs (main.c: one per dataset) on up to max_jobs threads.
+ *
+ * A run is admitted when the memory it is expected to take (bytes[job],
+ * from engine_bytes) fits in what the runs already going left of
+ * default_memory(), or when nothing else is running, so a dataset bigger
+ * than the machine still gets its turn alone (and cluster.c moves its
+ * matrices to files).  Runs are admitted in order, but a later one that
+ * fits goes ahead of an earlier one that does not yet.
+ *
+ * Every run prints into a buffer of its own and keeps its eval.c values;
+ * both go out, to stdout and to the result files, in job order as soon as
+ * every run before it is done, so stdout and skew.txt .. sc.txt come out
+ * as if the runs had gone one after another.  Messages on stderr are not
+ * held back.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "clust.h"
+
+enum {
+        JOB_WAITING,
+        JOB_RUNNING,
+        JOB_DONE
+};
+
+struct batch_job {
+        int state;
+        int status;             /* what the job_fn returned */
+        char *text;             /* what it printed */
+        size_t len;
+        double value[NUM_EVALS];
+};
+
+struct batch_s {
+        pthread_mutex_t lock;
+        pthread_cond_t change;  /* a run is done */
+        struct batch_job *job;
+        const size_t *bytes;
+        int num_jobs;
+        size_t budget;
+        size_t in_use;          /* bytes of the runs going */
+        int running;
+        int next_out;           /* first job not written out */
+        int failed;
+
+        job_fn fn;
+        void *ctx;
+};
+
+// the first waiting job that fits, else the first waiting one if nothing
+// runs; -1 if none may start now, num_jobs if none is left
+static int batch_pick(const struct batch_s *b)
+{
+        int j, first = -1;
+
+        for (j = 0; j < b->num_jobs; j++) {
+                if (b->job[j].state != JOB_WAITING)
+                        continue;
+                if (first < 0)
+                        first = j;
+                if (b->in_use <= b->budget
+                    && b->bytes[j] <= b->budget - b->in_use)
+                        return j;
+        }
+        if (first < 0)
+                return b->num_jobs;
+        return b->running == 0 ? first : -1;
+}
+
+static void batch_one(struct batch_s *b, int j)
+{
+        struct batch_job *job = &b->job[j];
+        FILE *out = open_memstream(&job->text, &job->len);
+
+        if (!out) {
+                alloc_fail("run output");
+                job->status = -1;
+                return;
+        }
+        job->status = b->fn(b->ctx, j, out, job->value);
+        if (fclose(out) != 0) {
+                alloc_fail("run output");
+                job->status = -1;
+        }
+}
+
+// the finished runs that are next in order, out; under b->lock
+static void batch_flush(struct batch_s *b)
+{
+        struct batch_job *job;
+
+        while (b->next_out < b->num_jobs
+               && b->job[b->next_out].state == JOB_DONE) {
+                job = &b->job[b->next_out++];
+                if (job->text)
+                        fwrite(job->text, 1, job->len, stdout);
+                fflush(stdout);
+                free(job->text);
+                job->text = NULL;
+                if (job->status == 0)
+                        eval_append(job->value);
+                else
+                        b->failed = 1;
+        }
+}
+
+static void *batch_thread(void *arg)
+{
+        struct batch_s *b = arg;
+        int j;
+
+        pthread_mutex_lock(&b->lock);
+        while ((j = batch_pick(b)) < b->num_jobs) {
+                if (j < 0) {
+                        pthread_cond_wait(&b->change, &b->lock);
+                        continue;
+                }
+                b->job[j].state = JOB_RUNNING;
+                b->running++;
+                b->in_use += b->bytes[j];
+                pthread_mutex_unlock(&b->lock);
+
+                batch_one(b, j);
+
+                pthread_mutex_lock(&b->lock);
+                b->job[j].state = JOB_DONE;
+                b->running--;
+                b->in_use -= b->bytes[j];
+                batch_flush(b);
+                pthread_cond_broadcast(&b->change);
+        }
+        pthread_mutex_unlock(&b->lock);
+        return NULL;
+}
+
+// fn for jobs 0 .. num_jobs-1, up to max_jobs at once, job j expected to
+// take bytes[j]; -1 if any of them failed
+int batch_run(int num_jobs, const size_t *bytes, int max_jobs, job_fn fn,
+              void *ctx)
+{
+        struct batch_s b;
+        pthread_t *tid;
+        int t, num_threads;
+
+        memset(&b, 0, sizeof(b));
+        b.job = alloc_mem(num_jobs, struct batch_job);
+        if (!b.job) {
+                alloc_fail("batch");
+                return -1;
+        }
+        if (max_jobs > num_jobs)
+                max_jobs = num_jobs;
+        tid = alloc_mem(max_jobs > 1 ? max_jobs : 1, pthread_t);
+        if (!tid)
+                max_jobs = 1;
+        pthread_mutex_init(&b.lock, NULL);
+        pthread_cond_init(&b.change, NULL);
+        b.bytes = bytes;
+        b.num_jobs = num_jobs;
+        b.budget = default_memory();
+        b.fn = fn;
+        b.ctx = ctx;
+
+        // the calling thread runs jobs too
+        for (num_threads = 1; num_threads < max_jobs; num_threads++)
+                if (pthread_create(&tid[num_threads], NULL, batch_thread,
+                                   &b) != 0)
+                        break;
+        batch_thread(&b);
+        for (t = 1; t < num_threads; t++)
+                pthread_join(tid[t], NULL);
+
+        pthread_mutex_destroy(&b.lock);
+        pthread_cond_destroy(&b.change);
+        free(tid);
+        free(b.job);
+        return b.failed ? -1 : 0;
+}
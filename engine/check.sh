@@ -0,0 +1,185 @@
+#!/bin/sh
+#
+# check.sh: the engine against the original programs, and its modes
+# against each other.
+#
+# usage: sh engine/check.sh [data_dir [copy ...]]
+#
+#   data_dir  with 1.txt .. 30.txt (default: the ones next to the copy in
+#             固定式代表點/散佈/平均距離(合併前)散佈版本/newaveragerefsc-link...)
+#   copy      numbers of the originals to check, 1 .. 60 in the sorted
+#             order of their paths (default: all)
+#
+# 1. golden: every clust_*.c under 固定式代表點/ and 變動式代表點/, with
+#    the memory it reads before writing zeroed (see patch_copy), is built
+#    with gcc -O0 and run on the datasets; its end, db, dunns, sp, sc and
+#    skew.txt must match those of the engine with its four axes (-f
+#    legacy, the default) byte for byte, the engine built with the
+#    NUM_ATTRS of the copy.
+# 2. modes: -f fixed -m matrix against -m lazy, rnn and emst, against
+#    matrices in files (-d) and against the .col files of -o col: the
+#    same clusters for every dataset.
+#
+# The scratch files go to a directory in $TMPDIR.  Exits 1 on a mismatch.
+
+top=$(cd "$(dirname "$0")/.." && pwd) || exit 1
+data=${1:-"$top/固定式代表點/散佈/平均距離(合併前)散佈版本/newaveragerefsc-link以(合併前)群集中心點選取代表點(動態配置陣列改完)"}
+[ $# -gt 0 ] && shift
+data=$(cd "$data" && pwd) || exit 1
+ls "$data"/[0-9]*.txt > /dev/null || exit 1
+work=$(mktemp -d "${TMPDIR:-/tmp}/check.XXXXXX") || exit 1
+trap 'rm -rf "$work"' EXIT
+failed=0
+
+# the copy on stdin with its reads of unwritten memory made defined:
+# accumulators start at 0, eval_centroid zeroes every attr, the arrays of
+# choose() are static (what the frame the caller reused gave them), the
+# mallocs it reads before writing are callocs, and the first row
+# update_smallest_dist rescans gets the next place when nothing in it is
+# below cell + 1 (a NaN cell), as in legacy.c; pi() only burned time
+patch_copy()
+{
+        sed -e 's/int skew,average,allitem;/int skew = 0,average,allitem;/' \
+            -e 's/for (attr_i = 0; attr_i < num_clusters; attr_i++)/for (attr_i = 0; attr_i < NUM_ATTRS; attr_i++)/' \
+            -e 's/double centroiddist ;/double centroiddist = 0 ;/' \
+            -e 's/float sum,allsum ;/float sum = 0,allsum ;/' \
+            -e 's/double samesum ;/double samesum = 0 ;/' \
+            -e 's/double same2sum ;/double same2sum = 0 ;/' \
+            -e 's/float choosea\[10000\] ;/float choosea[10000] = {0} ;/' \
+            -e 's/float chooseb\[10000\] ;/float chooseb[10000] = {0} ;/' \
+            -e 's/float si ;/float si = 0 ;/' \
+            -e 's/\(item_distances\|clu_distances\) = (float \*)malloc((num_items \* num_items)\* sizeof(float \*));/\1 = (float *)calloc(num_items * num_items, sizeof(float *));/' \
+            -e 's/arr = (int \*\*)malloc(\(.*\));/arr = (int **)calloc(1, \1);/' \
+            -e 's/double result = pi(1e8);/double result = 0;/' \
+            -e '/^void update_smallest_dist(/,/^}/{
+                    s/int min_index;/int min_index = -1;/
+                    s/\(min = clu_distances\[dist_index\] + 1.0;\)/\1 if (min_index < 0) min_index = i + 1;/
+                }' |
+        awk '/^void choose\(/ { c = 1 } c && /^}/ { c = 0 }
+             c && /^[ \t]*(int|float|double)[ \t]+[A-Za-z_0-9]+(\[[0-9]+\])+[ \t]*;/ {
+                     sub(/^[ \t]*/, "&static ")
+             }
+             { print }'
+}
+
+# the engine arguments of the copy at path
+copy_args()
+{
+        case "$1" in 固定式*) r=fixed ;; *) r=sqrt ;; esac
+        case "$1" in */散佈/*) p=spread ;; *) p=conc ;; esac
+        case "$1" in
+        */原始代表點/*) s=orig ;;
+        *最短距離*) s=center-min ;;
+        *各群中心選取代表點*) s=center ;;
+        *合併後*) s=avg-after ;;
+        *) s=avg-before ;;
+        esac
+        case "$(basename "$(dirname "$1")")" in
+        *fsc-link*) l=fsc ;;
+        *sc-link*) l=sc ;;
+        *) l=single ;;
+        esac
+        echo "-r $r -p $p -s $s -l $l"
+}
+
+# the engine for n attrs, once
+engine()
+{
+        if [ ! -x "$work/clust$1" ]; then
+                gcc -O2 -Wall -Wextra -pthread -DNUM_ATTRS=$1 \
+                    -o "$work/clust$1" "$top"/engine/*.c -lm || exit 1
+        fi
+        echo "$work/clust$1"
+}
+
+# a fresh directory with the datasets
+fresh()
+{
+        mkdir -p "$1" && cp "$data"/[0-9]*.txt "$1"/
+}
+
+# the clusters of a run: a line "dataset least-item item" for every item
+clusters()
+{
+        awk '/^[^ ].*: [0-9]+ items$/ { set = $1; sub(/\.[a-z]*:$/, "", set) }
+             /^node / {
+                     sub(/^node [0-9]+ \([0-9]+ items\): /, "")
+                     least = $1
+                     for (i = 2; i <= NF; i++)
+                             if ($i + 0 < least + 0)
+                                     least = $i
+                     for (i = 1; i <= NF; i++)
+                             print set, least, $i
+             }' "$1" | sort
+}
+
+cd "$top" || exit 1
+find 固定式代表點 變動式代表點 -name 'clust_*.c' | LC_ALL=C sort > "$work/copies"
+[ $# -gt 0 ] || set -- $(seq 1 "$(wc -l < "$work/copies")")
+
+for i in "$@"; do
+        src=$(sed -n "${i}p" "$work/copies")
+        n=$(sed -n 's/^#define NUM_ATTRS *\([0-9]*\).*/\1/p' "$src" | head -1)
+        bin=$(engine "${n:-9}") || exit 1
+        d="$work/golden/$i"
+        fresh "$d/orig" && fresh "$d/engine" || exit 1
+        patch_copy < "$src" > "$d/orig/p.c"
+        gcc -O0 -w -o "$d/orig/p" "$d/orig/p.c" -lm || exit 1
+        (cd "$d/orig" && ./p > out.log 2>&1)
+        (cd "$d/engine" && "$bin" $(copy_args "$src") > out.log 2>&1)
+        bad=
+        for f in end db dunns sp sc skew; do
+                if [ -f "$d/orig/$f.txt" ] || [ -f "$d/engine/$f.txt" ]; then
+                        cmp -s "$d/orig/$f.txt" "$d/engine/$f.txt" \
+                            || bad="$bad $f.txt"
+                fi
+        done
+        if [ -n "$bad" ]; then
+                echo "golden $i ($src):$bad differ"
+                failed=1
+        else
+                echo "golden $i: ok"
+        fi
+done
+
+# the clusters of -f fixed with args in directory dir against those of
+# the matrices there: check name dir args ...
+check()
+{
+        name=$1 dir=$2
+        shift 2
+        (cd "$dir" && "$bin" -f fixed "$@") > "$d/other.log" 2> /dev/null
+        if clusters "$d/other.log" | cmp -s - "$d/matrix"; then
+                echo "modes $name: ok"
+        else
+                echo "modes $name: other clusters"
+                failed=1
+        fi
+}
+
+bin=$(engine 9) || exit 1
+d="$work/modes"
+fresh "$d/run" && fresh "$d/col" && mkdir -p "$d/mat" "$d/small" || exit 1
+# the malformed datasets get no .col, and no clusters in any mode
+(cd "$d/col" && "$bin" -f fixed -o col [0-9]*.txt > /dev/null 2>&1)
+for l in single sc fsc; do
+        for s in orig center-min; do
+                a="-l $l -s $s"
+                check "$a" "$d/run" $a > /dev/null
+                clusters "$d/other.log" > "$d/matrix"
+                check "$a -m lazy" "$d/run" $a -m lazy
+                check "$a -d" "$d/run" $a -d "$d/mat"
+                check "$a .col" "$d/col" $a $(cd "$d/col" && ls [0-9]*.col)
+                [ $l = single ] && check "$a -m rnn" "$d/run" $a -m rnn
+        done
+done
+# emst is exact only while no cluster has more items than the rep cap:
+# the first 10 items of every dataset, cut at 3 clusters
+for z in "$d"/run/[0-9]*.txt; do
+        { echo 10; sed -n 2,11p "$z"; } > "$d/small/${z##*/}"
+done
+check "-k 3" "$d/small" -k 3 > /dev/null
+clusters "$d/other.log" > "$d/matrix"
+check "-k 3 -m emst (10 items)" "$d/small" -k 3 -m emst
+
+exit $failed
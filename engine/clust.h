@@ -0,0 +1,517 @@
+/**
+ * Representative-point hierarchical clustering engine.
+ *
+ * One engine for every variant under 固定式代表點/ and 變動式代表點/.
+ * The four axes that used to be separate copies of clust_0811_v1 (1).c
+ * are policies (see policy.h):
+ *
+ *   rep cap    固定式代表點 (at most 10 reps) / 變動式代表點 (floor(sqrt(n)))
+ *   selection  原始代表點, 平均距離(合併前), 平均距離(合併後),
+ *              各群中心選取代表點, 各群中心選取代表點+群集間最短距離
+ *   spread     集中 / 散佈
+ *   linkage    single-link, Sc-link, fSc-link
+ */
+
+#ifndef CLUST_H
+#define CLUST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "heap.h"
+#include "repslab.h"
+#include "trimat.h"
+
+#ifndef NUM_ATTRS
+#define NUM_ATTRS 9
+#endif
+/* from this many attributes on, item_distances is built in cache blocks
+   of items and attributes (tile.c) */
+#ifndef TILE_MIN_ATTRS
+#define TILE_MIN_ATTRS 32
+#endif
+/* from this many attributes on, the 固定式代表點 variants keep rep_ext rows
+   and link_dist reuses them instead of scanning all rep pairs (cluster.c) */
+#ifndef EXT_MIN_ATTRS
+#define EXT_MIN_ATTRS 32
+#endif
+/* cap on the memory of those rows; past it link_dist scans rep pairs */
+#ifndef EXT_MAX_BYTES
+#define EXT_MAX_BYTES ((size_t)1 << 30)
+#endif
+/* up to this many attributes the serial single-link loop of MODE_LAZY looks
+   up the nearest cluster of a rescanned row in a kd-tree of the reps */
+#ifndef KD_MAX_ATTRS
+#define KD_MAX_ATTRS 16
+#endif
+/* memory of the link cache that stands in for clu_distances in MODE_LAZY */
+#ifndef LINK_CACHE_BYTES
+#define LINK_CACHE_BYTES ((size_t)256 << 20)
+#endif
+/* and the rep-pair work (pairs x attributes) a link has to take to be
+   kept there; cheaper links are computed again */
+#ifndef LINK_CACHE_MIN_WORK
+#define LINK_CACHE_MIN_WORK 4096
+#endif
+#define TILE_ROWS 4 /* rows of a diff_tile */
+#define MAX_LABEL_LEN 16
+#define FIXED_REPS 10 /* rep cap of the 固定式代表點 variants */
+
+#define alloc_mem(N, T) (T *) calloc(N, sizeof(T))
+#define alloc_fail(M) fprintf(stderr,                                   \
+                              "Failed to allocate memory for %s.\n", M)
+#define read_fail(M) fprintf(stderr, "Failed to read %s from file.\n", M)
+
+typedef struct item_s item_t;
+typedef struct dist_rec_s dist_rec;
+typedef struct policy_s policy_t;
+typedef struct engine_s engine_t;
+typedef struct engine_opts_s engine_opts;
+typedef struct pool_s pool_t;
+
+// n... : new
+typedef struct nnode_s nnode;
+struct nnode_s {
+        int num_items; /* number of items that was clustered */
+        int first_item;
+        int last_item;
+};
+
+struct item_s {
+        float coord[NUM_ATTRS]; /* coordinate of the input data point */
+        char label[MAX_LABEL_LEN]; /* label of the input data point */
+};
+
+/* items attribute-major: attribute t of item i at col[t * ld + i]; every
+   column starts on a 64-byte boundary and is zero-padded to ld */
+typedef struct item_cols_s item_cols;
+struct item_cols_s {
+        int n;
+        int ld;
+        float *col;
+        void *map;     /* the .col file col and norm point into (colfile.c), */
+        size_t mapped; /* and its length; 0 if they are allocated */
+};
+
+/* what is done to an attribute before the distances (parse.c) */
+typedef enum {
+        NORM_SKIP,      /* left out: 0 for every item */
+        NORM_ZSCORE,    /* (x - mean) / sd */
+        NORM_MINMAX,    /* (x - min) / (max - min) */
+        NORM_LEGACY     /* z-score as the original programs take it, in
+                           float and item order, NaN for a constant
+                           attribute (legacy_input) */
+} norm_mode;
+
+/* x -> (x - shift[t]) / scale[t] for attribute t, 0 where scale[t] is 0
+   (a skipped or constant attribute) */
+typedef struct attr_norm_s attr_norm;
+struct attr_norm_s {
+        norm_mode mode[NUM_ATTRS];
+        float shift[NUM_ATTRS];
+        float scale[NUM_ATTRS];
+};
+
+/* kd-tree over some of the items, each tagged with the cluster it belongs
+   to (kdtree.c); points can be removed or moved to another cluster after
+   the build, the boxes stay as they were */
+typedef struct kd_node_s kd_node;
+struct kd_node_s {
+        float lo[NUM_ATTRS];   /* bounding box of the points below */
+        float hi[NUM_ATTRS];
+        int begin;             /* slots begin .. end-1 */
+        int end;
+        int left;              /* children, -1 for a leaf */
+        int right;
+        int owner;             /* cluster of every point below, -1 if mixed */
+        int max_owner;         /* largest cluster below, -1 if none */
+        int num_live;          /* points below not removed */
+};
+
+typedef struct kdtree_s kdtree;
+struct kdtree_s {
+        int num;
+        int num_nodes;
+        kd_node *node;         /* node 0 is the root */
+        int *item;             /* item in every slot */
+        int *owner;            /* its cluster, -1 once removed */
+        float *pt;             /* its coords, NUM_ATTRS per slot */
+        int *slot_of;          /* slot of every item, -1 if not in the tree */
+        int num_ids;           /* length of slot_of */
+};
+
+/* recently used cluster-to-cluster links (linkcache.c) */
+typedef struct link_slot_s link_slot;
+typedef struct link_cache_s link_cache;
+struct link_cache_s {
+        link_slot *slot;       /* LINK_WAYS per set, a cache line */
+        size_t num_sets;       /* a power of two */
+        unsigned tick;
+};
+
+/* closest point found so far by kd_nearest */
+typedef struct kd_hit_s kd_hit;
+struct kd_hit_s {
+        float dist;
+        int item;
+        int owner;
+        int tied;              /* another cluster is at the same dist */
+};
+
+/* distance kernels of one instruction set (kernels.c) */
+typedef struct dist_kernels_s dist_kernels;
+struct dist_kernels_s {
+        const char *name;
+        void (*dist_row)(const item_cols *c, int i, int j0, int j1,
+                         float *out);
+        void (*rep_minmax)(const float *a, int lda, int ka,
+                           const float *b, int ldb, int kb,
+                           float *mindist, float *maxdist);
+        void (*diff_tile)(const item_cols *c, int i0, int ni,
+                          int j0, int j1, int t0, int t1,
+                          float *acc, int ldacc);
+        void (*rep_dists)(const float *x, int ldx,
+                          const float *b, int ldb, int kb, float *out);
+};
+/* working space of one choose() caller, grown as needed and kept from
+   one merge to the next (cluster.c) */
+typedef struct scratch_s scratch;
+struct scratch_s {
+        void *p;
+        size_t bytes;
+};
+
+/* closest / farthest rep of one cluster as seen from an item x, and which
+   reps those are; a row of these per merged cluster lets link_dist reuse
+   the extrema of the two clusters it came from (cluster.c) */
+typedef struct rep_ext_s rep_ext;
+struct rep_ext_s {
+        float min;
+        float max;
+        int argmin;
+        int argmax;
+};
+
+struct dist_rec_s {
+       int index; // nodex index; smallest dist from a certain node i to node (index)
+       float dist;
+};
+
+typedef enum {
+        REP_FIXED,      /* 固定式代表點: min(n, FIXED_REPS) */
+        REP_SQRT,       /* 變動式代表點: floor(sqrt(n)) */
+        NUM_REP_POLICIES
+} rep_policy;
+
+typedef enum {
+        SEL_ORIGINAL,   /* 原始代表點: closest to the other cluster */
+        SEL_AVG_BEFORE, /* 平均距離(合併前): mean dist to the other cluster */
+        SEL_AVG_AFTER,  /* 平均距離(合併後): total dist inside the merged reps */
+        SEL_CENTER,     /* 各群中心選取代表點: total dist inside own cluster */
+        SEL_CENTER_MIN, /* +群集間最短距離: SEL_CENTER plus closest cross dist */
+        NUM_SELECTIONS
+} sel_policy;
+
+typedef enum {
+        SPREAD_CONCENTRATED, /* 集中: best reps of the union */
+        SPREAD_SCATTERED,    /* 散佈: quota from each side */
+        NUM_SPREADS
+} spread_policy;
+
+typedef enum {
+        LINK_SINGLE,    /* min */
+        LINK_SC,        /* max + min */
+        LINK_FSC,       /* 2 * max * min / (max + min) */
+        NUM_LINKAGES
+} link_policy;
+
+struct policy_s {
+        rep_policy rep;
+        sel_policy sel;
+        spread_policy spread;
+        link_policy link;
+};
+
+typedef void (*link_fn)(engine_t *e, int best_a);
+typedef int (*choose_fn)(engine_t *e, int best_a, int best_b, int *rep,
+                         scratch *s);
+typedef void (*range_fn)(void *ctx, int begin, int end);
+/* the copies of the original programs that were edited by hand, beyond
+   the four policy axes (legacy.c) */
+enum {
+        LEGACY_DB_MAX = 1,      /* db.txt sums the running max of the
+                                   Davies-Bouldin ratios */
+        LEGACY_DUNN_DIV = 2,    /* dunns.txt divides unless the diameter is
+                                   0, a 0 min dist included */
+        LEGACY_MIN_BY_B = 4     /* choose() takes the closest cross dist of
+                                   the first kb places of best_a's reps */
+};
+
+typedef struct legacy_copy_s legacy_copy;
+struct legacy_copy_s {
+        policy_t policy;
+        int num_clusters;       /* k it was built with */
+        int first_dataset;      /* of 1.txt .. 30.txt, the first it ran */
+        int eval_items;         /* item count skew.txt and end.txt divide by */
+        int num_attrs;          /* NUM_ATTRS it was built with */
+        int flags;
+};
+
+/* what choose() of the 散佈 copies keeps from one call to the next: the
+   reps of a cluster it ranks are read back past their count, into the
+   ones an earlier merge left there.  One per run of datasets, like the
+   static arrays of the original process. */
+typedef struct legacy_carry_s legacy_carry;
+struct legacy_carry_s {
+        int *item_a;            /* ranked reps of best_a, */
+        int *item_b;            /* of best_b */
+        int cap;
+        float min_a[FIXED_REPS]; /* LEGACY_MIN_BY_B: closest cross dists */
+};
+
+/* a run of batch.c: its text to out, its eval.c values to value */
+typedef int (*job_fn)(void *ctx, int job, FILE *out, double *value);
+/* a stage of pipeline.c, for one job */
+typedef void (*stage_fn)(void *ctx, int job);
+
+/* the values of a result, in the order eval_append writes them */
+enum {
+        EVAL_SKEW,      /* skew.txt */
+        EVAL_QE,        /* end.txt */
+        EVAL_DB,        /* db.txt */
+        EVAL_DUNN,      /* dunns.txt */
+        EVAL_SP,        /* sp.txt */
+        EVAL_SC,        /* sc.txt */
+        EVAL_DUNN_WIDTH, /* not a file: field width of dunns.txt, 6 for
+                            the 原始代表點 copies of the original programs */
+        NUM_EVALS
+};
+
+typedef enum {
+        MODE_MATRIX,    /* item / cluster distance matrices */
+        MODE_EMST,      /* Boruvka rounds over a kd-tree, single link (emst.c) */
+        MODE_LAZY,      /* no matrices: links from the reps when needed,
+                           the recent ones in a link_cache */
+        NUM_MODES
+} engine_mode;
+
+struct engine_opts_s {
+        int num_threads;
+        const dist_kernels *kernels;  /* NULL: widest the cpu runs */
+        engine_mode mode;
+        const char *matrix_dir;       /* MODE_MATRIX: keep the matrices in
+                                         files there; NULL: in memory, or
+                                         under $TMPDIR if they do not fit */
+        const item_cols *cols;        /* the items in columns already (a
+                                         .col file); NULL: made from items */
+        int rnn;                      /* -l single in MODE_MATRIX: merge in
+                                         rounds of reciprocal pairs (rnn.c) */
+        int legacy;                   /* MODE_MATRIX: merge like the original
+                                         programs (legacy.c) */
+        legacy_carry *carry;          /* legacy: shared by the datasets of a
+                                         run; NULL: one for this engine */
+};
+
+/* a merge of the dendrogram: b into a at height dist, the seq-th one */
+typedef struct merge_rec_s merge_rec;
+struct merge_rec_s {
+        int a;
+        int b;
+        int seq;
+        float dist;
+};
+
+struct engine_s {
+        policy_t policy;
+        link_fn link_dist;     /* kernels specialised for policy */
+        choose_fn choose;
+        int num_threads;
+        const dist_kernels *kern;
+        engine_mode mode;
+        const char *matrix_dir;
+
+        int num_items;
+        const item_t *items;   /* NULL when the columns came in opts */
+        item_cols cols;        /* items again, attribute-major */
+        int own_cols;          /* cols made here, not borrowed */
+        trimat item_distances; /* squared item-to-item dist; */
+        trimat clu_distances;  /* cluster-to-cluster dist by cluster id; */
+                               /* both only built in MODE_MATRIX */
+        link_cache links;      /* MODE_LAZY: links instead of clu_distances */
+
+        nnode *nodes_;         /* cluster by id; an id never moves */
+        int *next_live;        /* live ids in increasing order, -1 ends */
+        int *prev_live;
+        int first_live;
+        int *slot_of;          /* by id: its place in the nodes[] of the
+                                  original programs */
+        int *id_at;            /* by place: the id there */
+        nnode **nodes;         /* live clusters, filled when engine_run ends */
+        int *next_item;        /* item linked lists of the clusters */
+        repslab reps;          /* representative items of each cluster id */
+        int *rep;              /* reps picked by choose() for the merged cluster */
+        dist_rec *smallest_dist; // smallest dist from a node i to other live nodes j, j > i.
+        heap_t best;           /* live ids keyed on smallest_dist[i].dist */
+
+        rep_ext **ext;         /* by cluster id: ext[id][x] for every live rep x
+                                  of another cluster; NULL for a singleton */
+        rep_ext **ext_spare;   /* rows of merged-away clusters, for reuse */
+        int num_spare;
+        int num_rows;          /* rows allocated so far */
+        int ext_on;            /* 0 if not kept, or once out of memory */
+        int *rep_of;           /* cluster whose rep an item is, -1 if none */
+        kdtree tree;           /* -l single: reps of the live clusters, for
+                                  the rescans of the serial loop */
+        int kd_on;
+        int *kd_old;           /* reps of best_a and best_b before a merge */
+        float *centre;         /* 變動式代表點: centroid of every cluster's
+                                  reps, NUM_ATTRS each (NULL otherwise) */
+        float *radius;         /* and the dist of its farthest rep */
+        const rep_ext *ext_pa; /* rows of the two clusters best_a came from, */
+        const rep_ext *ext_pb; /* NULL for a singleton: */
+        int ext_ia, ext_ib;    /* then its only item */
+
+        pool_t *pool;          /* link_dist workers, NULL: one thread */
+        int *live_ids;         /* live ids but best_a, for the workers */
+        float *link_buf;       /* their link to best_a */
+        int *rescans;          /* rows to rescan after a merge, in id order */
+        int link_a;
+        int num_clusters_remaining;
+        int rnn;               /* merge in rounds of reciprocal pairs (rnn.c) */
+        int by_id;             /* the smaller id survives a merge, and
+                                  nodes[] is in id order (rnn.c, emst.c) */
+        int legacy;            /* merges of the original programs
+                                  (legacy.c); smallest_dist and the heap
+                                  are then by place, not by id */
+        const legacy_copy *copy;
+        legacy_carry *carry;
+        legacy_carry own_carry;
+        int *place_reps;       /* LEGACY_MIN_BY_B: FIXED_REPS per place, the
+                                  reps last written there */
+        scratch scratch;       /* of the choose() calls on this thread */
+};
+
+// squared dist of items i and j from their coords, as dist_row sums it
+static inline float col_dist(const item_cols *c, int i, int j)
+{
+        int t;
+        float diff, dist = 0.0f;
+
+        for (t = 0; t < NUM_ATTRS; t++) {
+                diff = c->col[(size_t)t * c->ld + i] - c->col[(size_t)t * c->ld + j];
+                dist += diff * diff;
+        }
+        return dist;
+}
+
+static inline float item_dist(const engine_t *e, int a, int b)
+{
+        if (a == b)
+                return 0.0f;
+        if (!e->item_distances.row)
+                return col_dist(&e->cols, a, b);
+        return tri_get(&e->item_distances, a, b);
+}
+
+/* policy.c */
+int parse_policy_arg(policy_t *p, char opt, const char *val);
+void print_policy(FILE *f, const policy_t *p);
+
+/* io.c */
+int item_cols_alloc(item_cols *c, const item_t *items, int num_items);
+void item_cols_free(item_cols *c);
+
+/* colfile.c */
+int col_write(const char *fname, const item_t *items, int num_items,
+              const attr_norm *norm);
+int col_is_file(const char *fname);
+int col_count(const char *fname);
+int col_map(item_cols *c, attr_norm *norm, const char *fname);
+void col_unmap(item_cols *c);
+
+/* parse.c */
+int process_input(item_t **items, const char *fname, int num_threads,
+                  attr_norm *norm);
+int input_count(const char *fname);
+int parse_norm_modes(norm_mode *mode, const char *spec);
+int legacy_input(item_t **items, const char *fname, attr_norm *norm);
+
+/* cluster.c */
+size_t engine_bytes(int num_items, const policy_t *policy,
+                    const engine_opts *opts);
+int engine_init(engine_t *e, const item_t *items, int num_items,
+                const policy_t *policy, const engine_opts *opts);
+void engine_run(engine_t *e, int num_clusters);
+void engine_free(engine_t *e);
+void print_nodes(const engine_t *e, int num_clusters, FILE *out);
+void merge_reps(engine_t *e, int best_a, int best_b);
+void merge_chosen(engine_t *e, int best_a, int best_b, const int *rep,
+                  int num_reps);
+void merge_followed(engine_t *e, kdtree *t, int *old, int best_a,
+                    int best_b, const int *rep, int num_reps);
+void release_ext(engine_t *e, int best_b);
+void splice_nodes(engine_t *e, int best_a, int best_b);
+void cut_merges(engine_t *e, const merge_rec *merges, int num_merges,
+                int num_clusters);
+void *scratch_get(scratch *s, size_t bytes);
+
+/* legacy.c */
+const legacy_copy *legacy_copy_of(const policy_t *policy);
+int legacy_choose(engine_t *e, int best_a, int best_b, int *rep,
+                  scratch *s);
+void legacy_run(engine_t *e, int num_clusters);
+void legacy_carry_free(legacy_carry *c);
+
+/* rnn.c */
+int rnn_run(engine_t *e, int num_clusters);
+
+/* emst.c */
+void emst_run(engine_t *e, int num_clusters);
+
+/* parallel.c */
+int default_threads(void);
+size_t default_memory(void);
+void parallel_rows(int num_threads, int n, range_fn fn, void *ctx);
+pool_t *pool_create(int num_threads);
+void pool_run(pool_t *p, range_fn fn, void *ctx, int n);
+void pool_free(pool_t *p);
+
+/* tile.c */
+void tile_dist_rows(engine_t *e, int begin, int end);
+
+/* kdtree.c */
+int kd_build(kdtree *t, const item_cols *c, const int *items,
+             const int *owners, int num);
+void kd_nearest(const kdtree *t, const float *q, int exclude, kd_hit *best);
+void kd_nearest_above(const kdtree *t, const float *q, int above,
+                      int exclude, kd_hit *best);
+void kd_remove(kdtree *t, int item);
+void kd_move(kdtree *t, int item, int owner);
+void kd_insert(kdtree *t, int item, int owner);
+int kd_compact(kdtree *t, const item_cols *c);
+void kd_free(kdtree *t);
+
+/* linkcache.c */
+size_t lc_bytes(int num_items, size_t max_bytes);
+int lc_alloc(link_cache *c, int num_items, size_t max_bytes);
+int lc_get(link_cache *c, int i, int j, float *dist);
+void lc_put(link_cache *c, int i, int j, float dist);
+void lc_free(link_cache *c);
+
+/* kernels.c */
+const dist_kernels *select_kernels(const char *name);
+
+/* eval.c */
+int eval_report(const engine_t *e, int num_clusters, FILE *out,
+                double *value);
+void eval_append(const double *value);
+
+/* batch.c */
+int batch_run(int num_jobs, const size_t *bytes, int max_jobs, job_fn fn,
+              void *ctx);
+
+/* pipeline.c */
+int pipeline_run(int num_jobs, const size_t *bytes, const stage_fn *stage,
+                 int num_stages, int depth, void *ctx);
+
+#endif
@@ -0,0 +1,1483 @@
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#include "clust.h"
+#include "policy.h"
+
+/* fewer live clusters than this and link_dist stays on one thread */
+#define PARALLEL_MIN_CLUSTERS 256
+/* nor a rescanned row goes to the kd-tree */
+#define KD_MIN_CLUSTERS 256
+/* fewer items than this and MODE_LAZY seeds its rows by scanning them:
+   a kd-tree search over many attributes visits much of a small tree */
+#define KD_MIN_SEED_ITEMS 16384
+/* links computed before they are written to clu_distances */
+#define LINK_BLOCK 64
+/* rows a rescan sweeps side by side */
+#define RESCAN_BLOCK 8
+/* reps per rep_dists call */
+#define DIST_CHUNK 64
+/* rep pairs from which a 變動式代表點 link goes through the bounding spheres */
+#define SPHERE_MIN_PAIRS 256
+/* relative rounding allowed for in the float dists of a sphere bound */
+#define SPHERE_SLACK (8.0 * NUM_ATTRS * FLT_EPSILON)
+
+/*
+    Every cluster keeps the id of the item it started from.  When best_a and
+    best_b merge, the merged cluster keeps best_a and best_b is unlinked from
+    the live list; no row or column of clu_distances moves, only rows best_a
+    (link_dist) and those whose nearest was best_b change.
+
+    Which of the two is best_a still follows the original programs, which
+    kept the clusters packed in nodes[0 .. num_clusters_remaining-1]: the
+    one in the lower place survives and goes first into choose(), and the
+    last place moves into the other one.  slot_of / id_at only track those
+    places; nothing is stored by them.
+
+    Every merged cluster also keeps a row of rep_ext: for each live rep x of
+    another cluster, its closest and farthest rep and their dists.  The
+    reps of a merged cluster are a subset of the reps of its two parents,
+    so the row of best_a is the elementwise better of the parents' rows
+    whenever that rep survived choose(); only entries whose extreme rep was
+    dropped are scanned again.  link(best_a, X) is then the min / max over
+    the k entries of X's reps, instead of a scan over all k x k rep pairs.
+
+    clu_distances / item_distances are packed upper triangles (trimat.h);
+    smallest_dist[i] is the closest j > i of row i.  The heap e->best mirrors
+    smallest_dist[].dist, so the best pair is at its top (heap.h).
+
+    MODE_LAZY builds neither triangle.  smallest_dist starts from item dists
+    made one row at a time, the new row of best_a goes into a bounded cache
+    (linkcache.c), and a rescan takes what the cache still has and computes
+    the rest from the reps.  The link of two clusters only changes when one
+    of them merges, so a link computed again is the one the matrix held.
+*/
+
+static void set_smallest(engine_t *e, int i, int index, float dist)
+{
+        e->smallest_dist[i].index = index;
+        e->smallest_dist[i].dist = dist;
+        heap_update(&e->best, i, dist);
+}
+
+// min / max of the dists from rep p of a to all the reps of b
+static void sphere_row(const engine_t *e, int a, int p, int b, int kb,
+                       float *mindist, float *maxdist)
+{
+        const float *ca = rep_coords(&e->reps, a) + p;
+        const float *cb = rep_coords(&e->reps, b);
+        int lda = rep_ld(&e->reps, a), ldb = rep_ld(&e->reps, b);
+        int j, q, num;
+        float dist[DIST_CHUNK];
+
+        for (j = 0; j < kb; j += DIST_CHUNK) {
+                num = kb - j < DIST_CHUNK ? kb - j : DIST_CHUNK;
+                e->kern->rep_dists(ca, lda, cb + j, ldb, num, dist);
+                for (q = 0; q < num; q++) {
+                        if (dist[q] < *mindist)
+                                *mindist = dist[q];
+                        if (dist[q] > *maxdist)
+                                *maxdist = dist[q];
+                }
+        }
+}
+
+// rep_minmax of two 變動式代表點 clusters, a the one with more reps, over
+// the bounding sphere of b: a rep p of a at D from centre[b] is between
+// D - radius[b] and D + radius[b] from every rep of b, so its row is only
+// scanned if that range reaches below the min or above the max so far.
+// The rows closest to and farthest from the centre go first.  The scanned
+// rows give the floats rep_minmax would, and the slack keeps the rounding
+// of D and the radius on the safe side, so the result is the same.
+static void sphere_minmax(const engine_t *e, int a, int ka, int b, int kb,
+                          int need_max, float *mindist, float *maxdist)
+{
+        const float *ca = rep_coords(&e->reps, a);
+        const float *centre = e->centre + (size_t)b * NUM_ATTRS;
+        double d, lo, hi, radius = e->radius[b];
+        int lda = rep_ld(&e->reps, a), p, j, num, near = 0, far = 0;
+        float d2[DIST_CHUNK], dmin = FLT_MAX, dmax = -1.0f;
+
+        *mindist = FLT_MAX;
+        *maxdist = 0.0f;
+        for (j = 0; j < ka; j += DIST_CHUNK) {
+                num = ka - j < DIST_CHUNK ? ka - j : DIST_CHUNK;
+                e->kern->rep_dists(centre, 1, ca + j, lda, num, d2);
+                for (p = 0; p < num; p++) {
+                        if (d2[p] < dmin) {
+                                dmin = d2[p];
+                                near = j + p;
+                        }
+                        if (d2[p] > dmax) {
+                                dmax = d2[p];
+                                far = j + p;
+                        }
+                }
+        }
+        sphere_row(e, a, near, b, kb, mindist, maxdist);
+        if (need_max && far != near)
+                sphere_row(e, a, far, b, kb, mindist, maxdist);
+        for (j = 0; j < ka; j += DIST_CHUNK) {
+                num = ka - j < DIST_CHUNK ? ka - j : DIST_CHUNK;
+                e->kern->rep_dists(centre, 1, ca + j, lda, num, d2);
+                for (p = 0; p < num; p++) {
+                        if (j + p == near || (need_max && j + p == far))
+                                continue;
+                        d = sqrt((double)d2[p]);
+                        lo = d * (1.0 - SPHERE_SLACK) - radius;
+                        hi = d * (1.0 + SPHERE_SLACK) + radius;
+                        if ((lo <= 0.0
+                             || lo * lo * (1.0 - SPHERE_SLACK) <= *mindist)
+                            || (need_max
+                                && hi * hi * (1.0 + SPHERE_SLACK) >= *maxdist))
+                                sphere_row(e, a, j + p, b, kb, mindist,
+                                           maxdist);
+                }
+        }
+}
+
+// linkage between the reps of node_i and the merged node best_a
+static ALWAYS_INLINE float rep_link(const engine_t *e, int best_a, int node_i,
+                                    rep_policy rep, link_policy link)
+{
+        int ka = rep_count(e->nodes_[best_a].num_items, rep);
+        int ki = rep_count(e->nodes_[node_i].num_items, rep);
+        float mindist, maxdist;
+
+        if (rep == REP_SQRT && ka * ki >= SPHERE_MIN_PAIRS) {
+                if (ka >= ki)
+                        sphere_minmax(e, best_a, ka, node_i, ki,
+                                      link_needs_max(link), &mindist, &maxdist);
+                else
+                        sphere_minmax(e, node_i, ki, best_a, ka,
+                                      link_needs_max(link), &mindist, &maxdist);
+                return link_combine(mindist, maxdist, link);
+        }
+        e->kern->rep_minmax(rep_coords(&e->reps, best_a),
+                            rep_ld(&e->reps, best_a), ka,
+                            rep_coords(&e->reps, node_i),
+                            rep_ld(&e->reps, node_i), ki,
+                            &mindist, &maxdist);
+        return link_combine(mindist, maxdist, link);
+}
+
+// MODE_LAZY keeps the link of i and j in the cache: a few rep pairs are
+// computed again faster than they are looked up
+static inline int link_cached(const engine_t *e, int i, int j)
+{
+        return (long)rep_count(e->nodes_[i].num_items, e->policy.rep)
+               * rep_count(e->nodes_[j].num_items, e->policy.rep)
+               * NUM_ATTRS >= LINK_CACHE_MIN_WORK;
+}
+
+// the same with the single link, from the kd-tree: the closest rep of a
+// cluster after i to any rep of i is the smallest dist of row i, ties to
+// the smaller id as the scan of the row has them
+static void rescan_tree(engine_t *e, int i, int skip)
+{
+        const float *coords = rep_coords(&e->reps, i);
+        int k = rep_count(e->nodes_[i].num_items, e->policy.rep);
+        int ld = rep_ld(&e->reps, i), r, t;
+        float q[NUM_ATTRS];
+        kd_hit best = { FLT_MAX, -1, -1, 0 };
+
+        for (r = 0; r < k; r++) {
+                for (t = 0; t < NUM_ATTRS; t++)
+                        q[t] = coords[t * ld + r];
+                // i is below above already: it stands for no skip
+                kd_nearest_above(&e->tree, q, i, skip >= 0 ? skip : i, &best);
+        }
+        set_smallest(e, i, best.owner, best.dist);
+}
+
+// smallest dist of row i over the live j > i but skip; index -1 if there
+// is none.  Without clu_distances (MODE_LAZY) a link not in the cache is
+// computed from the reps, and kept if it was worth it.
+static void rescan_row(engine_t *e, int i, int skip)
+{
+        int j, min_index = -1;
+        const float *row = NULL;
+        float dist, min = FLT_MAX;
+
+        if (e->kd_on && e->num_clusters_remaining >= KD_MIN_CLUSTERS) {
+                rescan_tree(e, i, skip);
+                return;
+        }
+        if (e->clu_distances.row) {
+                row = tri_row(&e->clu_distances, i);
+                trimat_prefetch(&e->clu_distances, i);
+        }
+        for (j = e->next_live[i]; j >= 0; j = e->next_live[j]) {
+                if (j == skip)
+                        continue;
+                if (row) {
+                        dist = row[j - i - 1];
+                } else if (!link_cached(e, i, j)) {
+                        dist = rep_link(e, i, j, e->policy.rep,
+                                        e->policy.link);
+                } else if (!lc_get(&e->links, i, j, &dist)) {
+                        dist = rep_link(e, i, j, e->policy.rep,
+                                        e->policy.link);
+                        lc_put(&e->links, i, j, dist);
+                }
+                if (dist < min) {
+                        min = dist;
+                        min_index = j;
+                }
+        }
+        set_smallest(e, i, min_index, min);
+}
+
+// rescan_row of the live rows[0 .. num-1], in increasing id order, in
+// one walk of the live list per RESCAN_BLOCK of them: the rows are read
+// side by side, a column of the block at a time
+static void rescan_rows(engine_t *e, const int *rows, int num, int skip)
+{
+        const float *row[RESCAN_BLOCK];
+        float min[RESCAN_BLOCK], dist;
+        int min_index[RESCAN_BLOCK];
+        int b, k, r, j, active;
+
+        if (!e->clu_distances.row || e->kd_on) {
+                for (b = 0; b < num; b++)
+                        rescan_row(e, rows[b], skip);
+                return;
+        }
+        for (b = 0; b < num; b += k) {
+                k = num - b < RESCAN_BLOCK ? num - b : RESCAN_BLOCK;
+                for (r = 0; r < k; r++) {
+                        row[r] = tri_row(&e->clu_distances, rows[b + r]);
+                        trimat_prefetch(&e->clu_distances, rows[b + r]);
+                        min[r] = FLT_MAX;
+                        min_index[r] = -1;
+                }
+                // rows[b .. b+active-1] are below j
+                active = 0;
+                for (j = e->next_live[rows[b]]; j >= 0; j = e->next_live[j]) {
+                        while (active < k && rows[b + active] < j)
+                                active++;
+                        if (j == skip)
+                                continue;
+                        for (r = 0; r < active; r++) {
+                                dist = row[r][j - rows[b + r] - 1];
+                                if (dist < min[r]) {
+                                        min[r] = dist;
+                                        min_index[r] = j;
+                                }
+                        }
+                }
+                for (r = 0; r < k; r++)
+                        set_smallest(e, rows[b + r], min_index[r], min[r]);
+        }
+}
+
+// copy the coords of the k reps of id into its coord block; with the sqrt
+// cap also the bounding sphere of the reps, its radius rounded up
+static void fill_rep_coords(engine_t *e, int id, int k)
+{
+        const int *reps = rep_slot(&e->reps, id);
+        float *coord = rep_coords(&e->reps, id), *centre;
+        int ld = rep_ld(&e->reps, id);
+        int r, t;
+        double sum, diff, dist, radius = 0.0;
+
+        for (r = 0; r < k; r++)
+                for (t = 0; t < NUM_ATTRS; t++)
+                        coord[t * ld + r] =
+                                e->cols.col[(size_t)t * e->cols.ld + reps[r]];
+        if (!e->centre)
+                return;
+        centre = e->centre + (size_t)id * NUM_ATTRS;
+        for (t = 0; t < NUM_ATTRS; t++) {
+                sum = 0.0;
+                for (r = 0; r < k; r++)
+                        sum += coord[t * ld + r];
+                centre[t] = (float)(sum / k);
+        }
+        for (r = 0; r < k; r++) {
+                dist = 0.0;
+                for (t = 0; t < NUM_ATTRS; t++) {
+                        diff = (double)coord[t * ld + r] - centre[t];
+                        dist += diff * diff;
+                }
+                if (dist > radius)
+                        radius = dist;
+        }
+        e->radius[id] = (float)(sqrt(radius) * (1.0 + SPHERE_SLACK));
+}
+
+// extrema of a singleton parent {item} seen from x at dist
+static ALWAYS_INLINE rep_ext single_ext(int item, float dist)
+{
+        rep_ext r;
+
+        r.min = r.max = dist;
+        r.argmin = r.argmax = item;
+        return r;
+}
+
+// extrema of the merged cluster link_a seen from the point at xc (stride
+// ldx), scanning its reps
+static ALWAYS_INLINE rep_ext ext_scan(const engine_t *e, const float *xc,
+                                      int ldx, rep_policy rep)
+{
+        const int *reps = rep_slot(&e->reps, e->link_a);
+        const float *coord = rep_coords(&e->reps, e->link_a);
+        int ld = rep_ld(&e->reps, e->link_a);
+        int i, j, num, k = rep_count(e->nodes_[e->link_a].num_items, rep);
+        float dist[DIST_CHUNK];
+        rep_ext r = { FLT_MAX, 0.0f, -1, -1 };
+
+        for (j = 0; j < k; j += DIST_CHUNK) {
+                num = k - j < DIST_CHUNK ? k - j : DIST_CHUNK;
+                e->kern->rep_dists(xc, ldx, coord + j, ld, num, dist);
+                for (i = 0; i < num; i++) {
+                        if (dist[i] < r.min) {
+                                r.min = dist[i];
+                                r.argmin = reps[j + i];
+                        }
+                        if (dist[i] > r.max) {
+                                r.max = dist[i];
+                                r.argmax = reps[j + i];
+                        }
+                }
+        }
+        return r;
+}
+
+// extrema of link_a seen from x out of those of its parents; exact as long
+// as the parents' closest (farthest) rep is still a rep of link_a
+static ALWAYS_INLINE rep_ext ext_merge(const engine_t *e, rep_ext ea,
+                                       rep_ext eb, const float *xc, int ldx,
+                                       rep_policy rep, link_policy link)
+{
+        int a = e->link_a;
+        rep_ext r;
+
+        if (ea.min < eb.min || (ea.min == eb.min && e->rep_of[ea.argmin] == a)) {
+                r.min = ea.min;
+                r.argmin = ea.argmin;
+        } else {
+                r.min = eb.min;
+                r.argmin = eb.argmin;
+        }
+        if (e->rep_of[r.argmin] != a)
+                return ext_scan(e, xc, ldx, rep);
+        if (link_needs_max(link)) {
+                if (ea.max > eb.max || (ea.max == eb.max && e->rep_of[ea.argmax] == a)) {
+                        r.max = ea.max;
+                        r.argmax = ea.argmax;
+                } else {
+                        r.max = eb.max;
+                        r.argmax = eb.argmax;
+                }
+                if (e->rep_of[r.argmax] != a)
+                        return ext_scan(e, xc, ldx, rep);
+        } else {
+                r.max = 0.0f;
+                r.argmax = r.argmin;
+        }
+        return r;
+}
+
+// linkage between link_a and node_i from the rep_ext rows; fills the
+// entries of node_i's reps in the row of link_a
+static ALWAYS_INLINE float ext_link(const engine_t *e, int node_i,
+                                    rep_policy rep, link_policy link)
+{
+        const int *reps = rep_slot(&e->reps, node_i);
+        const float *coord = rep_coords(&e->reps, node_i);
+        const float *col = e->cols.col;
+        int ld = rep_ld(&e->reps, node_i), cld = e->cols.ld;
+        int i, j, num, x, ki = rep_count(e->nodes_[node_i].num_items, rep);
+        rep_ext *row = e->ext[e->link_a], ea, eb, r;
+        float da[DIST_CHUNK], db[DIST_CHUNK];
+        float mindist = FLT_MAX, maxdist = 0.0f;
+
+        for (j = 0; j < ki; j += DIST_CHUNK) {
+                num = ki - j < DIST_CHUNK ? ki - j : DIST_CHUNK;
+                // a singleton parent has no row: its dists to these reps
+                if (e->ext_ia >= 0)
+                        e->kern->rep_dists(col + e->ext_ia, cld, coord + j, ld,
+                                           num, da);
+                if (e->ext_ib >= 0)
+                        e->kern->rep_dists(col + e->ext_ib, cld, coord + j, ld,
+                                           num, db);
+                for (i = 0; i < num; i++) {
+                        x = reps[j + i];
+                        ea = e->ext_pa ? e->ext_pa[x] : single_ext(e->ext_ia, da[i]);
+                        eb = e->ext_pb ? e->ext_pb[x] : single_ext(e->ext_ib, db[i]);
+                        r = ext_merge(e, ea, eb, coord + j + i, ld, rep, link);
+                        row[x] = r;
+                        if (r.min < mindist)
+                                mindist = r.min;
+                        if (r.max > maxdist)
+                                maxdist = r.max;
+                }
+        }
+        return link_combine(mindist, maxdist, link);
+}
+
+// link of best_a (e->link_a) to the live clusters live_ids[begin .. end-1],
+// into link_buf and clu_distances; every index is a different cell, so
+// ranges can run on different threads.  Above best_a the cells are a
+// column, one per row: those of a LINK_BLOCK are fetched while its links
+// are computed, then written together.
+static ALWAYS_INLINE void link_range_impl(engine_t *e, int begin, int end,
+                                          rep_policy rep, link_policy link)
+{
+        trimat *m = &e->clu_distances;
+        int idx, node_i, b, end_b, best_a = e->link_a;
+        float *row;
+
+        for (b = begin; b < end; b = end_b) {
+                end_b = end - b < LINK_BLOCK ? end : b + LINK_BLOCK;
+                if (m->row)
+                        for (idx = b; idx < end_b
+                             && (node_i = e->live_ids[idx]) < best_a; idx++)
+                                __builtin_prefetch(
+                                        &tri_row(m, node_i)[best_a - node_i - 1],
+                                        1);
+                for (idx = b; idx < end_b; idx++) {
+                        node_i = e->live_ids[idx];
+                        if (e->ext_on)
+                                e->link_buf[idx] =
+                                        ext_link(e, node_i, rep, link);
+                        else
+                                e->link_buf[idx] = rep_link(e, best_a, node_i,
+                                                            rep, link);
+                }
+                if (!m->row)
+                        continue;
+                for (idx = b; idx < end_b
+                     && (node_i = e->live_ids[idx]) < best_a; idx++)
+                        tri_row(m, node_i)[best_a - node_i - 1] =
+                                e->link_buf[idx];
+                row = tri_row(m, best_a);
+                for (; idx < end_b; idx++)
+                        row[e->live_ids[idx] - best_a - 1] = e->link_buf[idx];
+        }
+}
+
+// link of best_a to every other live cluster: live_ids[idx] and its link
+// in link_buf[idx] and clu_distances, computed by link_range (over the
+// pool when there are enough clusters); returns the number of them
+static int gather_links(engine_t *e, int best_a, range_fn link_range)
+{
+        int node_i, num = 0;
+
+        for (node_i = e->first_live; node_i >= 0; node_i = e->next_live[node_i])
+                if (node_i != best_a)
+                        e->live_ids[num++] = node_i;
+        e->link_a = best_a;
+        trimat_prefetch(&e->clu_distances, best_a);
+        if (e->pool && num >= PARALLEL_MIN_CLUSTERS)
+                pool_run(e->pool, link_range, e, num);
+        else
+                link_range(e, 0, num);
+        return num;
+}
+
+// [i, best_a] for live i < best_a, [best_a, i] for live i > best_a,
+// from gather_links; update smallest_dist afterwards, in id order:
+//   i < best_a:
+//        compare the current smallest_dist[i]->dist and clu_dist[i, best_a];
+//        Sc / fSc can grow after a merge, so a row whose smallest was
+//        best_a is rescanned when the new dist is larger
+//   i > best_a:
+//        choose the min for row best_a
+static void link_dist_impl(engine_t *e, int best_a, range_fn link_range)
+{
+        int idx, node_i, num, num_rescans = 0, min_index = -1;
+        float clu_dist, min = FLT_MAX;
+        dist_rec *smallest_dist = e->smallest_dist;
+
+        num = gather_links(e, best_a, link_range);
+        // the cache is not for the workers: the row goes in here, before
+        // the rescans below look for it
+        if (!e->clu_distances.row)
+                for (idx = 0; idx < num; idx++)
+                        if (link_cached(e, best_a, e->live_ids[idx]))
+                                lc_put(&e->links, best_a, e->live_ids[idx],
+                                       e->link_buf[idx]);
+        for (idx = 0; idx < num; idx++) {
+                node_i = e->live_ids[idx];
+                clu_dist = e->link_buf[idx];
+                if (node_i < best_a) {
+                        if (clu_dist < smallest_dist[node_i].dist)
+                                set_smallest(e, node_i, best_a, clu_dist);
+                        else if (smallest_dist[node_i].index == best_a
+                                 && clu_dist > smallest_dist[node_i].dist)
+                                e->rescans[num_rescans++] = node_i;
+                } else if (clu_dist < min) {
+                        min = clu_dist;
+                        min_index = node_i;
+                }
+        }
+        rescan_rows(e, e->rescans, num_rescans, -1);
+        set_smallest(e, best_a, min_index, min);
+}
+
+// sum of the dists from rep i of id to its other reps
+static float intra_sum(const engine_t *e, int id, int i, int k)
+{
+        const float *coord = rep_coords(&e->reps, id);
+        int j, c, num, ld = rep_ld(&e->reps, id);
+        float dist[DIST_CHUNK], sum = 0.0f;
+
+        for (c = 0; c < k; c += DIST_CHUNK) {
+                num = k - c < DIST_CHUNK ? k - c : DIST_CHUNK;
+                e->kern->rep_dists(coord + i, ld, coord + c, ld, num, dist);
+                for (j = 0; j < num; j++)
+                        if (c + j != i)
+                                sum += dist[j];
+        }
+        return sum;
+}
+
+// stats of the k_own reps of own against the k_other reps of other
+static void fill_rep_stats(const engine_t *e, int own, int k_own, int other,
+                           int k_other, rep_stat *stats, int need_intra)
+{
+        const int *reps = rep_slot(&e->reps, own);
+        const float *coord = rep_coords(&e->reps, own);
+        const float *coord_o = rep_coords(&e->reps, other);
+        int ld = rep_ld(&e->reps, own), ld_o = rep_ld(&e->reps, other);
+        int i, j, c, num;
+        float dist[DIST_CHUNK];
+
+        for (i = 0; i < k_own; i++) {
+                rep_stat *s = &stats[i];
+                s->item = reps[i];
+                s->cross_sum = 0.0f;
+                s->cross_min = FLT_MAX;
+                s->intra_sum = need_intra ? intra_sum(e, own, i, k_own) : 0.0f;
+                for (c = 0; c < k_other; c += DIST_CHUNK) {
+                        num = k_other - c < DIST_CHUNK ? k_other - c
+                                                       : DIST_CHUNK;
+                        e->kern->rep_dists(coord + i, ld, coord_o + c, ld_o,
+                                           num, dist);
+                        for (j = 0; j < num; j++) {
+                                s->cross_sum += dist[j];
+                                if (dist[j] < s->cross_min)
+                                        s->cross_min = dist[j];
+                        }
+                }
+        }
+}
+
+// x comes before y: smaller key, ties in their order before selection
+static inline int stat_before(const rep_stat *x, const rep_stat *y)
+{
+        return x->key < y->key || (x->key == y->key && x->pos < y->pos);
+}
+
+// max-heap on stat_before: the last of the kept stats at h[0]
+static void stat_sift(rep_stat *h, int i, int num)
+{
+        int c;
+        rep_stat tmp = h[i];
+
+        while ((c = 2 * i + 1) < num) {
+                if (c + 1 < num && stat_before(&h[c], &h[c + 1]))
+                        c++;
+                if (!stat_before(&tmp, &h[c]))
+                        break;
+                h[i] = h[c];
+                i = c;
+        }
+        h[i] = tmp;
+}
+
+// move the k first stats by key to stats[0 .. k-1], in order; O(num log k)
+// instead of sorting all num.  Ties keep the order of best_a reps before
+// best_b reps, as a stable sort would.
+static void select_top(rep_stat *stats, int num, int k)
+{
+        int i;
+        rep_stat tmp;
+
+        if (k > num)
+                k = num;
+        if (k <= 0)
+                return;
+        for (i = 0; i < num; i++)
+                stats[i].pos = i;
+        for (i = k / 2 - 1; i >= 0; i--)
+                stat_sift(stats, i, k);
+        for (i = k; i < num; i++)
+                if (stat_before(&stats[i], &stats[0])) {
+                        tmp = stats[0];
+                        stats[0] = stats[i];
+                        stats[i] = tmp;
+                        stat_sift(stats, 0, k);
+                }
+        for (i = k - 1; i > 0; i--) {
+                tmp = stats[0];
+                stats[0] = stats[i];
+                stats[i] = tmp;
+                stat_sift(stats, 0, i);
+        }
+}
+
+// share of the k new reps that comes from best_a in the 散佈 variants,
+// in proportion to floor(sqrt(size)) of both clusters
+static int spread_quota(int size_a, int size_b, int k, int ka, int kb)
+{
+        double sa = floor(sqrt((double)size_a));
+        double sb = floor(sqrt((double)size_b));
+        int qa = (int)floor(k * sa / (sa + sb) + 0.5);
+
+        if (qa > ka)
+                qa = ka;
+        if (k - qa > kb)
+                qa = k - kb;
+        return qa;
+}
+
+// pick the reps of the cluster merged from best_a and best_b;
+// returns the number of reps written to rep[]
+static ALWAYS_INLINE int choose_impl(engine_t *e, int best_a, int best_b,
+                                     int *rep, scratch *s, rep_policy rp,
+                                     sel_policy sel, spread_policy spread)
+{
+        int size_a = e->nodes_[best_a].num_items;
+        int size_b = e->nodes_[best_b].num_items;
+        int ka = rep_count(size_a, rp);
+        int kb = rep_count(size_b, rp);
+        int k = rep_count(size_a + size_b, rp);
+        rep_stat stats[2 * FIXED_REPS], *sa, *sb;
+        int i, qa;
+
+        if (k > ka + kb)
+                k = ka + kb;
+        if (ka + kb > 2 * FIXED_REPS)
+                sa = scratch_get(s, (size_t)(ka + kb) * sizeof(rep_stat));
+        else
+                sa = stats;
+        sb = sa + ka;
+
+        fill_rep_stats(e, best_a, ka, best_b, kb, sa, sel_needs_intra(sel));
+        fill_rep_stats(e, best_b, kb, best_a, ka, sb, sel_needs_intra(sel));
+        for (i = 0; i < ka; i++)
+                sa[i].key = sel_key(&sa[i], kb, sel);
+        for (i = 0; i < kb; i++)
+                sb[i].key = sel_key(&sb[i], ka, sel);
+
+        if (spread == SPREAD_CONCENTRATED) {
+                select_top(sa, ka + kb, k);
+                for (i = 0; i < k; i++)
+                        rep[i] = sa[i].item;
+        } else {
+                qa = spread_quota(size_a, size_b, k, ka, kb);
+                select_top(sa, ka, qa);
+                select_top(sb, kb, k - qa);
+                for (i = 0; i < qa; i++)
+                        rep[i] = sa[i].item;
+                for (i = qa; i < k; i++)
+                        rep[i] = sb[i - qa].item;
+        }
+        return k;
+}
+
+/*
+    one kernel per policy combination; the policy arguments are constants
+    here, so link_dist_impl / choose_impl are specialised with no branching
+    on the policy left in their loops
+*/
+#define DEFINE_LINK(r, R, l, L)                                         \
+        static void link_range_##r##_##l(void *e, int begin, int end)   \
+        {                                                               \
+                link_range_impl(e, begin, end, R, L);                   \
+        }                                                               \
+        static void link_dist_##r##_##l(engine_t *e, int best_a)        \
+        {                                                               \
+                link_dist_impl(e, best_a, link_range_##r##_##l);        \
+        }
+#define DEFINE_LINKS(r, R)                                              \
+        DEFINE_LINK(r, R, single, LINK_SINGLE)                          \
+        DEFINE_LINK(r, R, sc, LINK_SC)                                  \
+        DEFINE_LINK(r, R, fsc, LINK_FSC)
+
+DEFINE_LINKS(fixed, REP_FIXED)
+DEFINE_LINKS(sqrt, REP_SQRT)
+
+static const link_fn link_kernels[NUM_REP_POLICIES][NUM_LINKAGES] = {
+        { link_dist_fixed_single, link_dist_fixed_sc, link_dist_fixed_fsc },
+        { link_dist_sqrt_single, link_dist_sqrt_sc, link_dist_sqrt_fsc },
+};
+
+#define DEFINE_CHOOSE(r, R, s, S, p, P)                                 \
+        static int choose_##r##_##s##_##p(engine_t *e, int best_a,      \
+                                          int best_b, int *rep,         \
+                                          scratch *sc)                  \
+        {                                                               \
+                return choose_impl(e, best_a, best_b, rep, sc,          \
+                                   R, S, P);                            \
+        }
+#define DEFINE_CHOOSE_SPREADS(r, R, s, S)                               \
+        DEFINE_CHOOSE(r, R, s, S, conc, SPREAD_CONCENTRATED)            \
+        DEFINE_CHOOSE(r, R, s, S, spread, SPREAD_SCATTERED)
+#define DEFINE_CHOOSES(r, R)                                            \
+        DEFINE_CHOOSE_SPREADS(r, R, orig, SEL_ORIGINAL)                 \
+        DEFINE_CHOOSE_SPREADS(r, R, avgb, SEL_AVG_BEFORE)               \
+        DEFINE_CHOOSE_SPREADS(r, R, avga, SEL_AVG_AFTER)                \
+        DEFINE_CHOOSE_SPREADS(r, R, center, SEL_CENTER)                 \
+        DEFINE_CHOOSE_SPREADS(r, R, centermin, SEL_CENTER_MIN)
+
+DEFINE_CHOOSES(fixed, REP_FIXED)
+DEFINE_CHOOSES(sqrt, REP_SQRT)
+
+#define CHOOSE_ROW(r, s) { choose_##r##_##s##_conc, choose_##r##_##s##_spread }
+static const choose_fn choose_kernels[NUM_REP_POLICIES][NUM_SELECTIONS][NUM_SPREADS] = {
+        { CHOOSE_ROW(fixed, orig), CHOOSE_ROW(fixed, avgb),
+          CHOOSE_ROW(fixed, avga), CHOOSE_ROW(fixed, center),
+          CHOOSE_ROW(fixed, centermin) },
+        { CHOOSE_ROW(sqrt, orig), CHOOSE_ROW(sqrt, avgb),
+          CHOOSE_ROW(sqrt, avga), CHOOSE_ROW(sqrt, center),
+          CHOOSE_ROW(sqrt, centermin) },
+};
+
+#undef CHOOSE_ROW
+#undef DEFINE_CHOOSES
+#undef DEFINE_CHOOSE_SPREADS
+#undef DEFINE_CHOOSE
+#undef DEFINE_LINKS
+#undef DEFINE_LINK
+
+// append the items of best_b to best_a and drop best_b from the live list
+void splice_nodes(engine_t *e, int best_a, int best_b)
+{
+        nnode *a = &e->nodes_[best_a], *b = &e->nodes_[best_b];
+        int prev = e->prev_live[best_b], next = e->next_live[best_b];
+
+        e->next_item[a->last_item] = b->first_item;
+        a->last_item = b->last_item;
+        a->num_items += b->num_items;
+        b->num_items = 0;
+
+        if (prev >= 0)
+                e->next_live[prev] = next;
+        else
+                e->first_live = next;
+        if (next >= 0)
+                e->prev_live[next] = prev;
+        e->next_live[best_b] = e->prev_live[best_b] = -1;
+}
+
+static void nmerge(engine_t *e, int best_a, int best_b)
+{
+        splice_nodes(e, best_a, best_b);
+        heap_remove(&e->best, best_b);
+}
+
+// rows that had best_b as their nearest cluster, before the merge: the
+// link to best_a is still the one from its old reps, which link_dist
+// replaces afterwards
+static void drop_smallest_dist(engine_t *e, int best_a, int best_b)
+{
+        int i, num = 0;
+
+        for (i = e->first_live; i >= 0 && i < best_b; i = e->next_live[i])
+                if (i != best_a && e->smallest_dist[i].index == best_b)
+                        e->rescans[num++] = i;
+        rescan_rows(e, e->rescans, num, best_b);
+}
+
+// rows begin .. end-1 of item_distances and clu_distances, and their
+// smallest dist; every row is written by one thread only
+static void init_rows(void *ctx, int begin, int end)
+{
+        engine_t *e = ctx;
+        int i, j, k, min_index, n = e->num_items;
+        float min, *item_row, *clu_row;
+
+        // item to item distance (squared); the original programs summed
+        // every dist as dist_row does
+        if (NUM_ATTRS >= TILE_MIN_ATTRS)
+                tile_dist_rows(e, begin, end);
+        for (i = begin; i < end; i++) {
+                item_row = tri_row(&e->item_distances, i);
+                clu_row = tri_row(&e->clu_distances, i);
+                min = FLT_MAX;
+                min_index = -1;
+                if (NUM_ATTRS < TILE_MIN_ATTRS)
+                        e->kern->dist_row(&e->cols, i, i + 1, n, item_row);
+                // (i, j) is column k = j - i - 1 of row i
+                for (j = i + 1, k = 0; j < n; j++, k++) {
+                        // a singleton's only rep pair is both its min and
+                        // max, so Sc starts at 2 * dist; the original
+                        // programs started every link at the item dist
+                        clu_row[k] = e->legacy ? item_row[k]
+                                     : link_combine(item_row[k], item_row[k],
+                                                    e->policy.link);
+                        if (clu_row[k] < min || (e->legacy && k == 0)) {
+                                min = clu_row[k];
+                                min_index = j;
+                        }
+                }
+                // smallest dist from a node i to other nodes j, j > i
+                e->smallest_dist[i].index = min_index;
+                e->smallest_dist[i].dist = min;
+                e->best.key[i] = e->legacy && isnan(min) ? INFINITY : min;
+        }
+}
+
+// smallest dist of rows begin .. end-1 without the matrices (MODE_LAZY):
+// every row of item dists is made in a scratch row and only its min kept
+static void seed_rows(void *ctx, int begin, int end)
+{
+        engine_t *e = ctx;
+        int i, j, min_index, n = e->num_items;
+        float min, clu_dist, *row = alloc_mem(n, float);
+
+        if (!row) {
+                alloc_fail("scratch row");
+                exit(1);
+        }
+        for (i = begin; i < end; i++) {
+                e->kern->dist_row(&e->cols, i, i + 1, n, row);
+                min = FLT_MAX;
+                min_index = -1;
+                for (j = i + 1; j < n; j++) {
+                        clu_dist = link_combine(row[j - i - 1], row[j - i - 1],
+                                                e->policy.link);
+                        if (clu_dist < min) {
+                                min = clu_dist;
+                                min_index = j;
+                        }
+                }
+                e->smallest_dist[i].index = min_index;
+                e->smallest_dist[i].dist = min;
+                e->best.key[i] = min;
+        }
+        free(row);
+}
+
+// seed_rows from a kd-tree of the items: row i is answered with the
+// items after i in the tree and goes in next, from the last row up, so
+// the tree holds just the candidates of every query and its boxes fit
+// them.  Ties go to the smaller j, as the scan of the row has them.  The
+// link of two singletons has to grow with their dist for its min to be
+// that of the dist, which the harmonic mean of fSc does not do to the
+// last bit.  -1 if the rows are left to seed_rows.
+static int seed_tree(engine_t *e)
+{
+        kdtree t;
+        kd_hit best;
+        float q[NUM_ATTRS], min;
+        int i, d, n = e->num_items, *items;
+
+        if (NUM_ATTRS > KD_MAX_ATTRS || n < KD_MIN_SEED_ITEMS
+            || e->policy.link == LINK_FSC)
+                return -1;
+        items = alloc_mem(n, int);
+        if (!items)
+                return -1;
+        for (i = 0; i < n; i++)
+                items[i] = i;
+        d = kd_build(&t, &e->cols, items, items, n);
+        free(items);
+        if (d != 0)
+                return -1;
+        for (i = 0; i < n; i++)
+                kd_remove(&t, i);
+        for (i = n - 1; i >= 0; i--) {
+                for (d = 0; d < NUM_ATTRS; d++)
+                        q[d] = e->cols.col[(size_t)d * e->cols.ld + i];
+                best.dist = FLT_MAX;
+                best.item = best.owner = -1;
+                best.tied = 0;
+                kd_nearest(&t, q, i, &best);
+                min = best.owner >= 0 ? link_combine(best.dist, best.dist,
+                                                     e->policy.link)
+                                      : FLT_MAX;
+                e->smallest_dist[i].index = best.owner;
+                e->smallest_dist[i].dist = min;
+                e->best.key[i] = min;
+                kd_insert(&t, i, i);
+        }
+        kd_free(&t);
+        return 0;
+}
+
+static const char *tmp_dir(void)
+{
+        const char *dir = getenv("TMPDIR");
+
+        return dir && *dir ? dir : "/tmp";
+}
+
+// a matrix in memory, else in a file under dir or $TMPDIR
+static int matrix_alloc(trimat *m, int n, const char *dir)
+{
+        if (!dir) {
+                if (trimat_alloc(m, n) == 0)
+                        return 0;
+                dir = tmp_dir();
+                fprintf(stderr, "Distance matrix does not fit in memory, "
+                        "mapping it from a file in %s.\n", dir);
+        }
+        return trimat_map(m, n, dir);
+}
+
+// about the memory engine_init and engine_run take for num_items, for
+// batch.c to tell how many runs fit at once; matrices kept in files count
+// as nothing, the page cache gives them back
+size_t engine_bytes(int num_items, const policy_t *policy,
+                    const engine_opts *opts)
+{
+        size_t n = num_items, tri = n * (n > 0 ? n - 1 : 0) / 2;
+        size_t per_item, bytes;
+
+        // the arrays engine_init makes (the heap's too) and the columns,
+        // even when they come from a .col file
+        per_item = sizeof(nnode *) + sizeof(nnode) + sizeof(dist_rec)
+                   + 2 * sizeof(rep_ext *) + 11 * sizeof(int)
+                   + (NUM_ATTRS + 2) * sizeof(float);
+        // rep slots: FIXED_REPS each, or twice n in all for the sqrt cap,
+        // with the block tables of its free list
+        if (policy->rep == REP_FIXED)
+                per_item += FIXED_REPS * (sizeof(int)
+                                          + NUM_ATTRS * sizeof(float));
+        else
+                per_item += 2 * (sizeof(int) + NUM_ATTRS * sizeof(float))
+                            + 3 * sizeof(size_t) + 5 * sizeof(int)
+                            + (NUM_ATTRS + 1) * sizeof(float);
+        bytes = n * per_item;
+        if (!opts || opts->mode == MODE_MATRIX) {
+                if (!opts || !opts->matrix_dir)
+                        bytes += 2 * tri * sizeof(float);
+                if (policy->rep == REP_FIXED && NUM_ATTRS >= EXT_MIN_ATTRS)
+                        bytes += n * n * sizeof(rep_ext) < EXT_MAX_BYTES
+                                 ? n * n * sizeof(rep_ext) : EXT_MAX_BYTES;
+        } else if (opts->mode == MODE_LAZY) {
+                bytes += lc_bytes(num_items, LINK_CACHE_BYTES);
+        }
+        return bytes;
+}
+
+// every item its own node (cluster) and rep
+static void init_nodes(engine_t *e)
+{
+        int i, n = e->num_items;
+
+        for (i = 0; i < n; i++) {
+                e->nodes_[i].first_item = e->nodes_[i].last_item = i;
+                e->nodes_[i].num_items = 1;
+                e->next_item[i] = -1;
+                e->next_live[i] = i + 1 < n ? i + 1 : -1;
+                e->prev_live[i] = i - 1;
+                e->slot_of[i] = e->id_at[i] = i;
+                e->rep_of[i] = i;
+                fill_rep_coords(e, i, 1);
+        }
+        e->first_live = 0;
+        e->num_clusters_remaining = n;
+}
+
+int engine_init(engine_t *e, const item_t *items, int num_items,
+                const policy_t *policy, const engine_opts *opts)
+{
+        const char *dir = opts ? opts->matrix_dir : NULL;
+        int i, n = num_items;
+
+        memset(e, 0, sizeof(*e));
+        e->policy = *policy;
+        e->link_dist = link_kernels[policy->rep][policy->link];
+        e->choose = choose_kernels[policy->rep][policy->sel][policy->spread];
+        e->legacy = opts && opts->legacy && opts->mode == MODE_MATRIX
+                    && !opts->rnn;
+        if (e->legacy) {
+                e->choose = legacy_choose;
+                e->copy = legacy_copy_of(policy);
+                e->carry = opts->carry ? opts->carry : &e->own_carry;
+        }
+        e->num_threads = opts && opts->num_threads > 0 ? opts->num_threads : 1;
+        e->kern = opts && opts->kernels ? opts->kernels : select_kernels(NULL);
+        e->mode = opts ? opts->mode : MODE_MATRIX;
+        // both matrices stay in memory only if they fit in what is free
+        // now: past that, swap would write them out a page at a time,
+        // where the kernel writes back a mapped file in runs of rows
+        if (e->mode == MODE_MATRIX && !dir
+            && 2 * tri_size(n) * sizeof(float) > default_memory()) {
+                dir = tmp_dir();
+                fprintf(stderr, "Distance matrices take more than the free "
+                        "memory, mapping them from files in %s.\n", dir);
+        }
+        e->matrix_dir = dir;
+        e->items = items;
+        e->num_items = n;
+
+        e->nodes = alloc_mem(n, nnode *);
+        e->nodes_ = alloc_mem(n, nnode);
+        e->next_live = alloc_mem(n, int);
+        e->prev_live = alloc_mem(n, int);
+        e->slot_of = alloc_mem(n, int);
+        e->id_at = alloc_mem(n, int);
+        e->next_item = alloc_mem(n, int);
+        e->rep = alloc_mem(rep_count(n, policy->rep), int);
+        e->smallest_dist = alloc_mem(n, dist_rec);
+        e->live_ids = alloc_mem(n, int);
+        e->link_buf = alloc_mem(n, float);
+        e->rescans = alloc_mem(n, int);
+        e->ext = alloc_mem(n, rep_ext *);
+        e->ext_spare = alloc_mem(n, rep_ext *);
+        e->rep_of = alloc_mem(n, int);
+        if (e->legacy && (e->copy->flags & LEGACY_MIN_BY_B))
+                e->place_reps = alloc_mem((size_t)n * FIXED_REPS, int);
+        if (policy->rep == REP_SQRT) {
+                e->centre = alloc_mem((size_t)n * NUM_ATTRS, float);
+                e->radius = alloc_mem(n, float);
+        }
+        if (opts && opts->cols)
+                e->cols = *opts->cols;
+        else
+                e->own_cols = 1;
+        if ((e->own_cols && item_cols_alloc(&e->cols, items, n) != 0)
+            || (e->mode == MODE_MATRIX
+                && (matrix_alloc(&e->item_distances, n, dir) != 0
+                    || matrix_alloc(&e->clu_distances, n, dir) != 0))
+            || (e->mode == MODE_LAZY
+                && lc_alloc(&e->links, n, LINK_CACHE_BYTES) != 0)
+            || heap_alloc(&e->best, n) != 0
+            || repslab_alloc(&e->reps, n, policy->rep == REP_FIXED
+                             ? rep_count(n, REP_FIXED) : 0, NUM_ATTRS) != 0
+            || !e->nodes
+            || !e->nodes_ || !e->next_live || !e->prev_live
+            || !e->slot_of || !e->id_at || !e->next_item || !e->rep
+            || !e->smallest_dist || !e->live_ids || !e->link_buf
+            || !e->rescans
+            || !e->ext || !e->ext_spare || !e->rep_of
+            || (policy->rep == REP_SQRT && (!e->centre || !e->radius))
+            || (e->legacy && (e->copy->flags & LEGACY_MIN_BY_B)
+                && !e->place_reps)) {
+                alloc_fail("clustering engine");
+                engine_free(e);
+                return -1;
+        }
+        if (e->mode == MODE_MATRIX) {
+                // the O(n^2) part, split into row ranges of equal area
+                parallel_rows(e->num_threads, n, init_rows, e);
+                // item_distances waits for eval.c; link_dist writes a cell
+                // in every row above best_a
+                trimat_advise(&e->item_distances, TRI_IDLE);
+                trimat_advise(&e->clu_distances, TRI_SCATTER);
+        } else if (e->mode == MODE_LAZY) {
+                if (seed_tree(e) != 0)
+                        parallel_rows(e->num_threads, n, seed_rows, e);
+        } else {
+                // no rows: the heap only keeps the live ids for nmerge
+                for (i = 0; i < n; i++)
+                        e->best.key[i] = FLT_MAX;
+        }
+        // the heap of the original programs' scan has the places that
+        // have a row: all but the last
+        heap_build(&e->best, e->legacy && n > 0 ? n - 1 : n);
+        init_nodes(e);
+        if (e->place_reps)
+                for (i = 0; i < n; i++)
+                        e->place_reps[(size_t)i * FIXED_REPS] = i;
+        // with few attributes, or with the sqrt cap (whose choose() drops
+        // most extreme reps), scanning the rep pairs is cheaper
+        e->ext_on = e->mode == MODE_MATRIX && e->policy.rep == REP_FIXED
+                    && NUM_ATTRS >= EXT_MIN_ATTRS && !e->legacy;
+        // single link is reducible: the reps of a merged cluster are some of
+        // its parents' reps, so its min over them is never below both of
+        // theirs, as clu_distances starts from the dists link_dist computes
+        e->rnn = opts && opts->rnn && e->mode == MODE_MATRIX
+                 && e->policy.link == LINK_SINGLE;
+        // the rounds merge in another order than the serial loop, so they
+        // cannot know the places in nodes[]: with them every merge goes by
+        // id, those of the one-pair loop after rounds that gave up too
+        e->by_id = e->mode == MODE_EMST || e->rnn;
+        // workers for link_dist; without them it runs on this thread
+        e->pool = pool_create(e->num_threads);
+        return 0;
+}
+
+// stop keeping rep_ext rows; link_dist scans rep pairs from now on
+static void ext_disable(engine_t *e)
+{
+        int i;
+
+        for (i = 0; i < e->num_items; i++) {
+                free(e->ext[i]);
+                e->ext[i] = NULL;
+        }
+        while (e->num_spare > 0)
+                free(e->ext_spare[--e->num_spare]);
+        e->ext_on = 0;
+}
+
+// before best_a / best_b merge: remember the parents of the rep_ext row of
+// best_a and make sure best_a has a row
+static void ext_prepare(engine_t *e, int best_a, int best_b)
+{
+        const nnode *a = &e->nodes_[best_a], *b = &e->nodes_[best_b];
+
+        e->ext_ia = a->num_items == 1 ? a->first_item : -1;
+        e->ext_ib = b->num_items == 1 ? b->first_item : -1;
+        if (!e->ext[best_a] && e->num_spare > 0)
+                e->ext[best_a] = e->ext_spare[--e->num_spare];
+        if (!e->ext[best_a]) {
+                if ((size_t)(e->num_rows + 1) * e->num_items * sizeof(rep_ext)
+                    <= EXT_MAX_BYTES)
+                        e->ext[best_a] = alloc_mem(e->num_items, rep_ext);
+                e->num_rows++;
+                if (!e->ext[best_a]) {
+                        ext_disable(e);
+                        return;
+                }
+        }
+        // best_a's row is rewritten in place, entry by entry
+        e->ext_pa = e->ext_ia < 0 ? e->ext[best_a] : NULL;
+        e->ext_pb = e->ext_ib < 0 ? e->ext[best_b] : NULL;
+}
+
+// merge best_b into best_a: their items and the reps choose() picks
+void merge_reps(engine_t *e, int best_a, int best_b)
+{
+        merge_chosen(e, best_a, best_b, e->rep,
+                     e->choose(e, best_a, best_b, e->rep, &e->scratch));
+}
+
+// the same with the num_reps reps choose() picked for them already
+void merge_chosen(engine_t *e, int best_a, int best_b, const int *rep,
+                  int num_reps)
+{
+        const int *old;
+        int i, k;
+
+        // the reps of both clusters stop being reps unless chosen again
+        old = rep_slot(&e->reps, best_a);
+        k = rep_count(e->nodes_[best_a].num_items, e->policy.rep);
+        for (i = 0; i < k; i++)
+                e->rep_of[old[i]] = -1;
+        old = rep_slot(&e->reps, best_b);
+        k = rep_count(e->nodes_[best_b].num_items, e->policy.rep);
+        for (i = 0; i < k; i++)
+                e->rep_of[old[i]] = -1;
+        if (e->ext_on)
+                ext_prepare(e, best_a, best_b);
+
+        if (repslab_reserve(&e->reps, best_a, best_b, num_reps) != 0) {
+                alloc_fail("representative pool");
+                exit(1);
+        }
+        nmerge(e, best_a, best_b);
+        memcpy(rep_slot(&e->reps, best_a), rep, num_reps * sizeof(int));
+        for (i = 0; i < num_reps; i++)
+                e->rep_of[rep[i]] = best_a;
+        fill_rep_coords(e, best_a, num_reps);
+        e->num_clusters_remaining--;
+}
+
+// after the links of a merge are done, best_b's rep_ext row is free
+void release_ext(engine_t *e, int best_b)
+{
+        if (e->ext[best_b]) {
+                e->ext_spare[e->num_spare++] = e->ext[best_b];
+                e->ext[best_b] = NULL;
+        }
+}
+
+static void kd_off(engine_t *e)
+{
+        kd_free(&e->tree);
+        free(e->kd_old);
+        e->kd_old = NULL;
+        e->kd_on = 0;
+}
+
+// merge_chosen, and t follows it: the reps choose() dropped leave it and
+// best_b's others move to best_a.  old has room for the reps of both.
+void merge_followed(engine_t *e, kdtree *t, int *old, int best_a,
+                    int best_b, const int *rep, int num_reps)
+{
+        int i, x;
+        int ka = rep_count(e->nodes_[best_a].num_items, e->policy.rep);
+        int kb = rep_count(e->nodes_[best_b].num_items, e->policy.rep);
+
+        memcpy(old, rep_slot(&e->reps, best_a), ka * sizeof(int));
+        memcpy(old + ka, rep_slot(&e->reps, best_b), kb * sizeof(int));
+        merge_chosen(e, best_a, best_b, rep, num_reps);
+        for (i = 0; i < ka + kb; i++) {
+                x = old[i];
+                if (e->rep_of[x] < 0)
+                        kd_remove(t, x);
+                else if (i >= ka)
+                        kd_move(t, x, best_a);
+        }
+}
+
+static void merge_pair(engine_t *e, int best_a, int best_b)
+{
+        drop_smallest_dist(e, best_a, best_b);
+        if (e->kd_on) {
+                int k = e->choose(e, best_a, best_b, e->rep, &e->scratch);
+
+                merge_followed(e, &e->tree, e->kd_old, best_a, best_b, e->rep,
+                               k);
+                // rows are scanned from here on; most of the singletons'
+                // slots are dead after a while
+                if (e->num_clusters_remaining < KD_MIN_CLUSTERS)
+                        kd_off(e);
+                else if (2 * e->tree.node[0].num_live < e->tree.num
+                         && kd_compact(&e->tree, &e->cols) != 0)
+                        kd_off(e);
+        } else {
+                merge_reps(e, best_a, best_b);
+        }
+        // compute dist from each node to the merged node,
+        // which possibly affects smallest_dist[]
+        e->link_dist(e, best_a);
+        release_ext(e, best_b);
+}
+
+static int merge_before(const void *p, const void *q)
+{
+        const merge_rec *x = p, *y = q;
+
+        if (x->dist != y->dist)
+                return x->dist < y->dist ? -1 : 1;
+        // the serial loop takes equal dists by the smaller row first
+        if (x->a != y->a)
+                return x->a - y->a;
+        return x->seq - y->seq;
+}
+
+static int find_root(int *root, int i)
+{
+        while (root[i] != i)
+                i = root[i] = root[root[i]];
+        return i;
+}
+
+// k = num_clusters clusters out of a whole dendrogram (rnn.c, emst.c):
+// rebuild the item lists from its n - k lowest merges, ties to the smaller
+// id, joined in the order they were made; a cluster keeps its smallest
+// item as id, like in the serial loop
+void cut_merges(engine_t *e, const merge_rec *merges, int num_merges,
+                int num_clusters)
+{
+        merge_rec *sorted = alloc_mem(num_merges > 0 ? num_merges : 1, merge_rec);
+        char *keep = alloc_mem(num_merges > 0 ? num_merges : 1, char);
+        int *root = alloc_mem(e->num_items, int);
+        int i, a, b, n = e->num_items, num_keep = n - num_clusters;
+
+        if (!sorted || !keep || !root) {
+                alloc_fail("dendrogram cut");
+                exit(1);
+        }
+        for (i = 0; i < num_merges; i++)
+                sorted[i] = merges[i];
+        qsort(sorted, num_merges, sizeof(merge_rec), merge_before);
+        for (i = 0; i < num_keep && i < num_merges; i++)
+                keep[sorted[i].seq] = 1;
+
+        for (i = 0; i < n; i++) {
+                e->nodes_[i].first_item = e->nodes_[i].last_item = i;
+                e->nodes_[i].num_items = 1;
+                e->next_item[i] = -1;
+                e->next_live[i] = i + 1 < n ? i + 1 : -1;
+                e->prev_live[i] = i - 1;
+                root[i] = i;
+        }
+        e->first_live = 0;
+        e->num_clusters_remaining = n;
+        for (i = 0; i < num_merges; i++) {
+                if (!keep[i])
+                        continue;
+                a = find_root(root, merges[i].a);
+                b = find_root(root, merges[i].b);
+                if (a == b)
+                        continue;
+                if (a > b) {
+                        b = a;
+                        a = find_root(root, merges[i].b);
+                }
+                splice_nodes(e, a, b);
+                root[b] = a;
+                e->num_clusters_remaining--;
+        }
+        free(sorted);
+        free(keep);
+        free(root);
+}
+
+// back to the singletons when the rnn.c rounds give up.  The rounds only
+// read the matrices and never touch smallest_dist or the heap keys, so
+// those are still what engine_init made; the nodes and reps are made again
+// and the rep_ext rows kept for the next merges.
+static void engine_reset(engine_t *e)
+{
+        int i, n = e->num_items;
+
+        repslab_free(&e->reps);
+        if (repslab_alloc(&e->reps, n, e->policy.rep == REP_FIXED
+                          ? rep_count(n, REP_FIXED) : 0, NUM_ATTRS) != 0) {
+                alloc_fail("representative pool");
+                exit(1);
+        }
+        for (i = 0; i < n; i++)
+                release_ext(e, i);
+        heap_build(&e->best, n);
+        init_nodes(e);
+        trimat_advise(&e->clu_distances, TRI_SCATTER);
+        e->rnn = 0;
+}
+
+// room for bytes in s, kept from one merge to the next
+void *scratch_get(scratch *s, size_t bytes)
+{
+        void *p;
+
+        if (bytes > s->bytes) {
+                p = realloc(s->p, bytes);
+                if (!p) {
+                        alloc_fail("choose scratch");
+                        exit(1);
+                }
+                s->p = p;
+                s->bytes = bytes;
+        }
+        return s->p;
+}
+
+// the cluster in the last place of nodes[] moves into best_b's, after
+// num_clusters_remaining went down
+static void move_last_slot(engine_t *e, int best_b)
+{
+        int last = e->id_at[e->num_clusters_remaining];
+
+        e->id_at[e->slot_of[best_b]] = last;
+        e->slot_of[last] = e->slot_of[best_b];
+}
+
+// the reps of the live clusters in e->tree, for the rescans of the serial
+// single-link loop; without the memory for it they scan rows
+static void kd_on(engine_t *e)
+{
+        int i, r, k, num = 0, n = e->num_items;
+        int *items = alloc_mem(n, int), *owners = alloc_mem(n, int);
+        const int *reps;
+
+        e->kd_old = alloc_mem(2 * rep_count(n, e->policy.rep), int);
+        if (items && owners && e->kd_old) {
+                for (i = e->first_live; i >= 0; i = e->next_live[i]) {
+                        reps = rep_slot(&e->reps, i);
+                        k = rep_count(e->nodes_[i].num_items, e->policy.rep);
+                        for (r = 0; r < k; r++) {
+                                items[num] = reps[r];
+                                owners[num++] = i;
+                        }
+                }
+                e->kd_on = kd_build(&e->tree, &e->cols, items, owners,
+                                    num) == 0;
+        }
+        if (!e->kd_on)
+                kd_off(e);
+        free(items);
+        free(owners);
+}
+
+void engine_run(engine_t *e, int num_clusters)
+{
+        int i, best_a, best_b, num;
+
+        if (e->legacy) {
+                legacy_run(e, num_clusters);
+                return;
+        }
+        if (e->mode == MODE_EMST)
+                emst_run(e, num_clusters);
+        else if (e->rnn && rnn_run(e, num_clusters) != 0)
+                engine_reset(e);
+        // with clu_distances a row is read faster than the tree is kept
+        if (e->mode == MODE_LAZY && e->policy.link == LINK_SINGLE
+            && NUM_ATTRS <= KD_MAX_ATTRS
+            && e->num_clusters_remaining > num_clusters
+            && e->num_clusters_remaining >= KD_MIN_CLUSTERS)
+                kd_on(e);
+        while (e->num_clusters_remaining > num_clusters
+               && e->num_clusters_remaining > 1) {
+                // best pair: first row with the smallest dist
+                best_a = heap_top(&e->best);
+                best_b = e->smallest_dist[best_a].index;
+                if (e->by_id) {
+                        merge_pair(e, best_a, best_b);
+                        continue;
+                }
+                if (e->slot_of[best_b] < e->slot_of[best_a]) {
+                        i = best_a;
+                        best_a = best_b;
+                        best_b = i;
+                }
+                merge_pair(e, best_a, best_b);
+                move_last_slot(e, best_b);
+        }
+        if (e->kd_on)
+                kd_off(e);
+
+        if (e->by_id)
+                for (i = e->first_live, num = 0; i >= 0; i = e->next_live[i])
+                        e->nodes[num++] = &e->nodes_[i];
+        else
+                for (num = 0; num < e->num_clusters_remaining; num++)
+                        e->nodes[num] = &e->nodes_[e->id_at[num]];
+}
+
+void engine_free(engine_t *e)
+{
+        legacy_carry_free(&e->own_carry);
+        free(e->place_reps);
+        free(e->scratch.p);
+        repslab_free(&e->reps);
+        if (e->own_cols)
+                item_cols_free(&e->cols);
+        pool_free(e->pool);
+        if (e->ext)
+                ext_disable(e);
+        free(e->ext);
+        free(e->ext_spare);
+        free(e->rep_of);
+        free(e->centre);
+        free(e->radius);
+        free(e->live_ids);
+        free(e->link_buf);
+        free(e->rescans);
+        trimat_free(&e->item_distances);
+        trimat_free(&e->clu_distances);
+        lc_free(&e->links);
+        heap_free(&e->best);
+        free(e->nodes);
+        free(e->nodes_);
+        free(e->next_live);
+        free(e->prev_live);
+        free(e->slot_of);
+        free(e->id_at);
+        free(e->next_item);
+        free(e->rep);
+        free(e->smallest_dist);
+        memset(e, 0, sizeof(*e));
+}
+
+// the items in each node (cluster)
+void print_nodes(const engine_t *e, int num_clusters, FILE *out)
+{
+        int i, n, ptr;
+        fprintf(out, "items in node\n");
+        for (i = 0; i < num_clusters; i++) {
+                ptr = e->nodes[i]->first_item;
+                n = e->nodes[i]->num_items;
+                fprintf(out, "node %d (%d items): ", i, n);
+                while (n > 0) {
+                        fprintf(out, "%d ", ptr);
+                        ptr = e->next_item[ptr];
+                        n--;
+                }
+                fprintf(out, "\n");
+        }
+}
@@ -0,0 +1,228 @@
+/**
+ * Binary columnar datasets (.col): the items already normalized and laid
+ * out the way item_cols keeps them, so a run maps the file and hands the
+ * columns to the engine without parsing, normalizing or copying.
+ *
+ *   offset 0      col_header
+ *   attrs         a col_attr for each attribute: the normalization the
+ *                 column went through (attr_norm)
+ *   columns       d columns of ld floats each, zero-padded, every one on a
+ *                 64-byte boundary
+ *
+ * Everything is in the byte order of the machine that wrote it; a file
+ * from another byte order, another NUM_ATTRS or another version is
+ * refused.  `clust -o col N.txt` writes N.col.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "clust.h"
+
+#define COL_MAGIC "CLUSTCOL"
+#define COL_VERSION 2
+#define COL_ALIGN 64
+
+enum {
+        COL_FLOAT32 = 1
+};
+
+typedef struct col_header_s col_header;
+struct col_header_s {
+        char magic[8];
+        uint32_t version;
+        uint32_t dtype;        /* COL_FLOAT32 */
+        uint64_t n;
+        uint32_t d;            /* attributes, NUM_ATTRS of the writer */
+        uint32_t attr_size;    /* sizeof(col_attr) */
+        uint64_t ld;           /* floats per column */
+        uint64_t attrs;        /* offsets into the file */
+        uint64_t columns;
+        uint64_t size;         /* of the whole file */
+};
+
+typedef struct col_attr_s col_attr;
+struct col_attr_s {
+        uint32_t mode;         /* norm_mode */
+        float shift;
+        float scale;
+};
+
+static uint64_t align_up(uint64_t x)
+{
+        return (x + COL_ALIGN - 1) & ~(uint64_t)(COL_ALIGN - 1);
+}
+
+// header of n items in columns of ld
+static void fill_header(col_header *h, int n, int ld)
+{
+        memset(h, 0, sizeof(*h));
+        memcpy(h->magic, COL_MAGIC, sizeof(h->magic));
+        h->version = COL_VERSION;
+        h->dtype = COL_FLOAT32;
+        h->n = n;
+        h->d = NUM_ATTRS;
+        h->attr_size = sizeof(col_attr);
+        h->ld = ld;
+        h->attrs = align_up(sizeof(*h));
+        h->columns = align_up(h->attrs + NUM_ATTRS * sizeof(col_attr));
+        h->size = h->columns + NUM_ATTRS * (uint64_t)ld * sizeof(float);
+}
+
+static int write_at(int fd, const void *p, size_t len, uint64_t off)
+{
+        const char *b = p;
+        ssize_t r;
+
+        while (len > 0) {
+                r = pwrite(fd, b, len, (off_t)off);
+                if (r <= 0)
+                        return -1;
+                b += r;
+                len -= r;
+                off += r;
+        }
+        return 0;
+}
+
+// the normalized items and the norm that got them there into fname
+int col_write(const char *fname, const item_t *items, int num_items,
+              const attr_norm *norm)
+{
+        col_attr attr[NUM_ATTRS];
+        item_cols c;
+        col_header h;
+        int fd, t, status = 0;
+
+        if (item_cols_alloc(&c, items, num_items) != 0) {
+                alloc_fail("item columns");
+                return -1;
+        }
+        fill_header(&h, num_items, c.ld);
+        memset(attr, 0, sizeof(attr));
+        for (t = 0; t < NUM_ATTRS; t++) {
+                attr[t].mode = norm->mode[t];
+                attr[t].shift = norm->shift[t];
+                attr[t].scale = norm->scale[t];
+        }
+        fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+                fprintf(stderr, "Failed to open output file %s.\n", fname);
+                item_cols_free(&c);
+                return -1;
+        }
+        // the gaps between the parts read back as zeros
+        if (ftruncate(fd, (off_t)h.size) != 0
+            || write_at(fd, &h, sizeof(h), 0) != 0
+            || write_at(fd, attr, sizeof(attr), h.attrs) != 0
+            || write_at(fd, c.col, (size_t)NUM_ATTRS * c.ld * sizeof(float),
+                        h.columns) != 0) {
+                fprintf(stderr, "Failed to write %s.\n", fname);
+                status = -1;
+        }
+        if (close(fd) != 0)
+                status = -1;
+        item_cols_free(&c);
+        return status;
+}
+
+// 1 if fname starts like a .col file
+int col_is_file(const char *fname)
+{
+        char magic[8];
+        int fd = open(fname, O_RDONLY), is_col;
+
+        if (fd < 0)
+                return 0;
+        is_col = read(fd, magic, sizeof(magic)) == (ssize_t)sizeof(magic)
+                 && memcmp(magic, COL_MAGIC, sizeof(magic)) == 0;
+        close(fd);
+        return is_col;
+}
+
+// the number of items of the .col file fname, from its header; 0 if it
+// is not one
+int col_count(const char *fname)
+{
+        col_header h;
+        int fd = open(fname, O_RDONLY);
+        ssize_t r;
+
+        if (fd < 0)
+                return 0;
+        r = read(fd, &h, sizeof(h));
+        close(fd);
+        if (r != (ssize_t)sizeof(h)
+            || memcmp(h.magic, COL_MAGIC, sizeof(h.magic)) != 0
+            || h.n > INT32_MAX)
+                return 0;
+        return (int)h.n;
+}
+
+// map fname and point c at its columns, and tell in norm (if not NULL)
+// how they were normalized; the number of items, or 0 and a message if
+// the file is not one this build can use
+int col_map(item_cols *c, attr_norm *norm, const char *fname)
+{
+        const col_header *h;
+        const col_attr *attr;
+        col_header want;
+        struct stat st;
+        void *p;
+        int fd, t;
+
+        memset(c, 0, sizeof(*c));
+        fd = open(fname, O_RDONLY);
+        if (fd < 0) {
+                fprintf(stderr, "Failed to open input file %s.\n", fname);
+                return 0;
+        }
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(col_header)) {
+                fprintf(stderr, "%s: not a .col file.\n", fname);
+                close(fd);
+                return 0;
+        }
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+                fprintf(stderr, "Failed to map %s.\n", fname);
+                return 0;
+        }
+        h = p;
+        if (h->n > 0 && h->n <= INT32_MAX && h->ld >= h->n && h->ld % 16 == 0
+            && h->ld <= INT32_MAX)
+                fill_header(&want, (int)h->n, (int)h->ld);
+        else
+                memset(&want, 0, sizeof(want));
+        if (memcmp(h, &want, sizeof(want)) != 0
+            || h->size != (uint64_t)st.st_size) {
+                fprintf(stderr, "%s: not a .col file of this version, byte "
+                        "order and NUM_ATTRS (%d).\n", fname, NUM_ATTRS);
+                munmap(p, st.st_size);
+                return 0;
+        }
+        c->n = (int)h->n;
+        c->ld = (int)h->ld;
+        c->col = (float *)((char *)p + h->columns);
+        c->map = p;
+        c->mapped = st.st_size;
+        if (norm)
+                for (t = 0; t < NUM_ATTRS; t++) {
+                        attr = (const col_attr *)((char *)p + h->attrs) + t;
+                        norm->mode[t] = attr->mode;
+                        norm->shift[t] = attr->shift;
+                        norm->scale[t] = attr->scale;
+                }
+        // engine_init reads all of it right away
+        madvise(p, st.st_size, MADV_WILLNEED);
+        return c->n;
+}
+
+void col_unmap(item_cols *c)
+{
+        munmap(c->map, c->mapped);
+}
@@ -0,0 +1,183 @@
+/**
+ * Boruvka rounds over a kd-tree of the reps: the single-link hierarchy
+ * without item_distances or clu_distances (MODE_EMST).
+ *
+ * Every round puts the reps of all live clusters into a kd-tree tagged
+ * with their cluster, and every cluster looks up the closest rep of any
+ * other cluster from each of its own reps.  Those edges are then taken in
+ * increasing order, and each one that still joins two different clusters
+ * merges them with choose() as usual, so the rep cap applies to the merged
+ * clusters and the next round only sees their reps.  Every cluster merges
+ * at least once a round, so there are about log2(n) rounds.
+ *
+ * Without the cap (clusters smaller than their rep count) the edges are
+ * those of the Euclidean minimum spanning tree and the cut at k clusters
+ * is the exact single-link one.  With the cap an edge is found from the
+ * reps the clusters had when the round started, which a merge earlier in
+ * the same round may have dropped, so the heights can differ a little
+ * from the serial loop's.  A merge keeps the smaller id, as in rnn.c,
+ * not the lower place in nodes[] the serial loop keeps.
+ */
+
+#include <float.h>
+#include <stdlib.h>
+
+#include "clust.h"
+#include "policy.h"
+
+/* fewer live clusters than this and the queries stay on one thread */
+#define PARALLEL_MIN_QUERIES 256
+
+/* closest other cluster of a live cluster, and the two reps it is
+   between */
+typedef struct emst_edge_s emst_edge;
+struct emst_edge_s {
+        float dist;
+        int from;
+        int to;
+        int from_item;
+        int to_item;
+};
+
+struct emst_s {
+        engine_t *e;
+        kdtree tree;
+        emst_edge *edge;       /* by index into live_ids */
+        int *items;            /* reps of all live clusters */
+        int *owners;           /* and their cluster */
+};
+
+static void nearest_range(void *ctx, int begin, int end)
+{
+        struct emst_s *m = ctx;
+        const engine_t *e = m->e;
+        const item_cols *c = &e->cols;
+        int idx, id, r, t, k, item, from_item;
+        const int *reps;
+        float q[NUM_ATTRS], dist;
+        kd_hit best;
+
+        for (idx = begin; idx < end; idx++) {
+                id = e->live_ids[idx];
+                reps = rep_slot(&e->reps, id);
+                k = rep_count(e->nodes_[id].num_items, e->policy.rep);
+                best.dist = FLT_MAX;
+                best.item = best.owner = -1;
+                best.tied = 0;
+                from_item = -1;
+                for (r = 0; r < k; r++) {
+                        for (t = 0; t < NUM_ATTRS; t++)
+                                q[t] = c->col[(size_t)t * c->ld + reps[r]];
+                        dist = best.dist;
+                        item = best.item;
+                        kd_nearest(&m->tree, q, id, &best);
+                        if (best.dist != dist || best.item != item)
+                                from_item = reps[r];
+                }
+                m->edge[idx].dist = best.dist;
+                m->edge[idx].from = id;
+                m->edge[idx].to = best.owner;
+                m->edge[idx].from_item = from_item;
+                m->edge[idx].to_item = best.item;
+        }
+}
+
+static int edge_before(const void *p, const void *q)
+{
+        const emst_edge *x = p, *y = q;
+        int xa = x->from < x->to ? x->from : x->to;
+        int ya = y->from < y->to ? y->from : y->to;
+
+        if (x->dist != y->dist)
+                return x->dist < y->dist ? -1 : 1;
+        if (xa != ya)
+                return xa - ya;
+        return (x->from + x->to - xa) - (y->from + y->to - ya);
+}
+
+static int find_root(int *root, int i)
+{
+        while (root[i] != i)
+                i = root[i] = root[root[i]];
+        return i;
+}
+
+// one round: closest other cluster of every live cluster, then the merges
+static void emst_round(struct emst_s *m, int *root,
+                       merge_rec *merges, int *num_merges)
+{
+        engine_t *e = m->e;
+        int i, k, r, id, a, b, num = 0, num_reps = 0;
+        const int *reps;
+
+        for (id = e->first_live; id >= 0; id = e->next_live[id]) {
+                e->live_ids[num++] = id;
+                reps = rep_slot(&e->reps, id);
+                k = rep_count(e->nodes_[id].num_items, e->policy.rep);
+                for (r = 0; r < k; r++) {
+                        m->items[num_reps] = reps[r];
+                        m->owners[num_reps++] = id;
+                }
+        }
+        if (kd_build(&m->tree, &e->cols, m->items, m->owners, num_reps) != 0) {
+                alloc_fail("kd-tree");
+                exit(1);
+        }
+        if (e->pool && num >= PARALLEL_MIN_QUERIES)
+                pool_run(e->pool, nearest_range, m, num);
+        else
+                nearest_range(m, 0, num);
+        kd_free(&m->tree);
+
+        qsort(m->edge, num, sizeof(emst_edge), edge_before);
+        for (i = 0; i < num; i++) {
+                a = find_root(root, m->edge[i].from);
+                b = find_root(root, m->edge[i].to);
+                if (a == b)
+                        continue;
+                if (a > b) {
+                        b = a;
+                        a = find_root(root, m->edge[i].to);
+                }
+                // the cut replays the tree edges, which join the reps: the
+                // rounds do not merge in order of height, so by cluster id
+                // a kept edge could join what a cut one did
+                merges[*num_merges].a = m->edge[i].from_item;
+                merges[*num_merges].b = m->edge[i].to_item;
+                merges[*num_merges].seq = *num_merges;
+                merges[*num_merges].dist = m->edge[i].dist;
+                (*num_merges)++;
+                merge_reps(e, a, b);
+                root[b] = a;
+        }
+}
+
+void emst_run(engine_t *e, int num_clusters)
+{
+        struct emst_s m;
+        merge_rec *merges;
+        int *root, i, num_merges = 0, n = e->num_items;
+
+        if (e->num_clusters_remaining <= num_clusters)
+                return;
+        m.e = e;
+        m.edge = alloc_mem(n, emst_edge);
+        merges = alloc_mem(n, merge_rec);
+        m.items = alloc_mem(n, int);
+        m.owners = alloc_mem(n, int);
+        root = alloc_mem(n, int);
+        if (!m.edge || !merges || !m.items || !m.owners || !root) {
+                alloc_fail("spanning tree");
+                exit(1);
+        }
+        for (i = 0; i < n; i++)
+                root[i] = i;
+        while (e->num_clusters_remaining > 1)
+                emst_round(&m, root, merges, &num_merges);
+        cut_merges(e, merges, num_merges, num_clusters);
+        free(m.edge);
+        free(merges);
+        free(m.items);
+        free(m.owners);
+        free(root);
+}
@@ -0,0 +1,573 @@
+/**
+ * Quality of a clustering result, appended to the same files as the
+ * original programs: skew.txt, end.txt (qe), db.txt, dunns.txt, sp.txt,
+ * sc.txt.  Distances are Euclidean (item_distances keeps squares).
+ * eval_report only measures; eval_append writes, so a batch (batch.c)
+ * can hold the values of a run until the runs before it are out.
+ */
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#include "clust.h"
+
+// value as "%f", in a field of width (0: as wide as it takes), or as
+// "%d" for skew.txt, an int in the original programs
+static void append_result(const char *fname, double value, int width,
+                          int as_int)
+{
+        FILE *fp = fopen(fname, "a");
+        if (!fp) {
+                fprintf(stderr, "Failed to open output file %s.\n", fname);
+                return;
+        }
+        if (as_int)
+                fprintf(fp, "%d \n", (int)value);
+        else
+                fprintf(fp, "%*f \n", width, value);
+        fclose(fp);
+}
+
+static float coord_dist(const float *a, const float *b)
+{
+        int k;
+        float d, sum = 0.0f;
+        for (k = 0; k < NUM_ATTRS; k++) {
+                d = a[k] - b[k];
+                sum += d * d;
+        }
+        return sqrtf(sum);
+}
+
+// cluster index of every item; centroid of every cluster
+static void eval_centroid(const engine_t *e, int num_clusters,
+                          int *cluster_of, float *cents)
+{
+        int i, j, k, item_i;
+        const nnode *node;
+
+        for (i = 0; i < num_clusters; i++) {
+                node = e->nodes[i];
+                float *c = cents + i * NUM_ATTRS;
+                memset(c, 0, NUM_ATTRS * sizeof(float));
+                item_i = node->first_item;
+                for (j = 0; j < node->num_items; j++) {
+                        cluster_of[item_i] = i;
+                        for (k = 0; k < NUM_ATTRS; k++)
+                                c[k] += e->cols.col[(size_t)k * e->cols.ld
+                                                    + item_i];
+                        item_i = e->next_item[item_i];
+                }
+                for (k = 0; k < NUM_ATTRS; k++)
+                        c[k] /= (float)node->num_items;
+        }
+}
+
+// sum of |n / C - cluster size|
+static double eval_skew(const engine_t *e, int num_clusters)
+{
+        int i, average = e->num_items / num_clusters;
+        double skew = 0.0;
+        for (i = 0; i < num_clusters; i++)
+                skew += abs(average - e->nodes[i]->num_items);
+        return skew;
+}
+
+// quantization error (mean dist to own centroid) and Davies-Bouldin index
+static void eval_qe(const engine_t *e, int num_clusters,
+                    const int *cluster_of, const float *cents,
+                    double *qe, double *db)
+{
+        int i, j, c, t;
+        double sum = 0.0, worst, ratio;
+        double *scatter = alloc_mem(num_clusters, double);
+        float x[NUM_ATTRS];
+
+        if (!scatter) {
+                alloc_fail("cluster scatter");
+                *qe = *db = 0.0;
+                return;
+        }
+        for (i = 0; i < e->num_items; i++) {
+                c = cluster_of[i];
+                for (t = 0; t < NUM_ATTRS; t++)
+                        x[t] = e->cols.col[(size_t)t * e->cols.ld + i];
+                float d = coord_dist(cents + c * NUM_ATTRS, x);
+                sum += d;
+                scatter[c] += d;
+        }
+        for (c = 0; c < num_clusters; c++)
+                scatter[c] /= e->nodes[c]->num_items;
+        *qe = sum / e->num_items;
+
+        sum = 0.0;
+        for (i = 0; i < num_clusters; i++) {
+                worst = 0.0;
+                for (j = 0; j < num_clusters; j++) {
+                        if (i == j)
+                                continue;
+                        float m = coord_dist(cents + i * NUM_ATTRS,
+                                             cents + j * NUM_ATTRS);
+                        ratio = m > 0 ? (scatter[i] + scatter[j]) / m : 0.0;
+                        if (ratio > worst)
+                                worst = ratio;
+                }
+                sum += worst;
+        }
+        *db = sum / num_clusters;
+        free(scatter);
+}
+
+// Dunn's index: smallest dist between clusters / largest cluster diameter
+static double dunns_index(const engine_t *e, const int *cluster_of)
+{
+        int i, j;
+        float d, min_between = FLT_MAX, max_diameter = 0.0f;
+
+        for (i = 0; i < e->num_items; i++) {
+                for (j = i + 1; j < e->num_items; j++) {
+                        d = item_dist(e, i, j);
+                        if (cluster_of[i] == cluster_of[j]) {
+                                if (d > max_diameter)
+                                        max_diameter = d;
+                        } else if (d < min_between)
+                                min_between = d;
+                }
+        }
+        if (max_diameter == 0.0f || min_between == FLT_MAX)
+                return 0.0;
+        return sqrt(min_between) / sqrt(max_diameter);
+}
+
+// separation: mean dist between cluster centroids
+static double eval_sp(const float *cents, int num_clusters)
+{
+        int i, j;
+        double sum = 0.0;
+
+        if (num_clusters < 2)
+                return 0.0;
+        for (i = 0; i < num_clusters; i++)
+                for (j = i + 1; j < num_clusters; j++)
+                        sum += coord_dist(cents + i * NUM_ATTRS,
+                                          cents + j * NUM_ATTRS);
+        return sum / ((double)num_clusters * (num_clusters - 1) / 2);
+}
+
+// sums[i * num_clusters + c]: dist from item i to all other items of
+// cluster c, in one sweep over the rows of the triangle.  Item i gets the
+// dists to j < i from the rows before its own, so it adds them in the
+// same order as a scan of all j.
+static void sc_sums(const engine_t *e, int num_clusters, const int *cluster_of,
+                    double *sums)
+{
+        int i, j;
+        double d;
+
+        for (i = 0; i < e->num_items; i++)
+                for (j = i + 1; j < e->num_items; j++) {
+                        d = sqrt(item_dist(e, i, j));
+                        sums[(size_t)i * num_clusters + cluster_of[j]] += d;
+                        sums[(size_t)j * num_clusters + cluster_of[i]] += d;
+                }
+}
+
+// silhouette coefficient averaged over all items
+static double eval_sc(const engine_t *e, int num_clusters,
+                      const int *cluster_of)
+{
+        int i, j, c;
+        double a, b, total = 0.0;
+        double *sums = alloc_mem((size_t)e->num_items * num_clusters, double);
+        double *dist_to = sums ? NULL : alloc_mem(num_clusters, double);
+
+        // without room for all the sums, one item at a time, which reads
+        // the triangle a column at a time as well
+        if (!sums && !dist_to) {
+                alloc_fail("silhouette sums");
+                return 0.0;
+        }
+        if (sums)
+                sc_sums(e, num_clusters, cluster_of, sums);
+        for (i = 0; i < e->num_items; i++) {
+                if (sums) {
+                        dist_to = sums + (size_t)i * num_clusters;
+                } else {
+                        memset(dist_to, 0, num_clusters * sizeof(double));
+                        for (j = 0; j < e->num_items; j++)
+                                if (j != i)
+                                        dist_to[cluster_of[j]] +=
+                                                sqrt(item_dist(e, i, j));
+                }
+                c = cluster_of[i];
+                if (e->nodes[c]->num_items == 1)
+                        continue; // s(i) = 0
+                a = dist_to[c] / (e->nodes[c]->num_items - 1);
+                b = DBL_MAX;
+                for (j = 0; j < num_clusters; j++)
+                        if (j != c && dist_to[j] / e->nodes[j]->num_items < b)
+                                b = dist_to[j] / e->nodes[j]->num_items;
+                if (b == DBL_MAX)
+                        continue;
+                total += (b - a) / (a > b ? a : b);
+        }
+        if (sums)
+                free(sums);
+        else
+                free(dist_to);
+        return total / e->num_items;
+}
+
+/*
+    The measures as the original programs took them (legacy.c): float sums
+    in their loop order, accumulators that go on from one cluster to the
+    next, NaN where they divide 0 by 0, and the clusters in nodes[] order.
+    They are not what their names say (the functions above are), but they
+    are what the result files of the copies hold.
+*/
+
+static inline float legacy_coord(const engine_t *e, int item, int t)
+{
+        return e->cols.col[(size_t)t * e->cols.ld + item];
+}
+
+// centroids, summed over the items in list order
+static void legacy_centroid(const engine_t *e, int num_clusters,
+                            float *cents)
+{
+        int i, j, t, item;
+        const nnode *node;
+        float *c;
+
+        for (i = 0; i < num_clusters; i++) {
+                node = e->nodes[i];
+                c = cents + i * NUM_ATTRS;
+                memset(c, 0, NUM_ATTRS * sizeof(float));
+                item = node->first_item;
+                for (j = 0; j < node->num_items; j++) {
+                        for (t = 0; t < NUM_ATTRS; t++)
+                                c[t] += legacy_coord(e, item, t);
+                        item = e->next_item[item];
+                }
+                for (t = 0; t < NUM_ATTRS; t++)
+                        c[t] /= (float)node->num_items;
+        }
+}
+
+// sum of |items / C - cluster size|, items the size the copy was made for
+static int legacy_skew(const engine_t *e, int num_clusters, int items)
+{
+        int i, skew = 0, average = items / num_clusters;
+
+        for (i = 0; i < num_clusters; i++)
+                skew += abs(average - e->nodes[i]->num_items);
+        return skew;
+}
+
+// qe: sum of the dists to the own centroid (an attribute whose square is
+// over 1000 left out); db: for every cluster the ratio to the
+// last other one, over a centroid dist that keeps adding up
+static void legacy_qe(const engine_t *e, int num_clusters, const float *cents,
+                      int db_max, float *qe, double *db)
+{
+        float *scatter = alloc_mem(num_clusters, float);
+        float sum = 0.0f, sum2 = 0.0f, dist, sq, ratio = 0.0f, max = 0.0f;
+        float all = 0.0f;
+        double centroid_dist = 0.0;
+        const float *ci, *cj;
+        int i, j, t, item;
+
+        if (!scatter) {
+                alloc_fail("cluster scatter");
+                *qe = 0.0f;
+                *db = 0.0;
+                return;
+        }
+        for (i = 0; i < num_clusters; i++) {
+                ci = cents + i * NUM_ATTRS;
+                item = e->nodes[i]->first_item;
+                for (j = 0; j < e->nodes[i]->num_items; j++) {
+                        dist = 0.0f;
+                        for (t = 0; t < NUM_ATTRS; t++) {
+                                sq = (ci[t] - legacy_coord(e, item, t))
+                                     * (ci[t] - legacy_coord(e, item, t));
+                                if (!(sq > 1000))
+                                        dist += sq;
+                        }
+                        sum += sqrt(dist);
+                        sum2 += dist;
+                        item = e->next_item[item];
+                }
+                sum2 /= e->nodes[i]->num_items;
+                scatter[i] = sum2;
+        }
+        for (i = 0; i < num_clusters; i++) {
+                ci = cents + i * NUM_ATTRS;
+                for (j = 0; j < num_clusters; j++) {
+                        if (!db_max)
+                                max = 0.0f;
+                        if (i == j)
+                                continue;
+                        cj = cents + j * NUM_ATTRS;
+                        for (t = 0; t < NUM_ATTRS; t++)
+                                centroid_dist += sqrt((ci[t] - cj[t])
+                                                      * (ci[t] - cj[t]));
+                        ratio = (scatter[i] + scatter[j]) / centroid_dist;
+                        if (ratio > max)
+                                max = ratio;
+                }
+                all += db_max ? max : ratio;
+        }
+        *qe = sum;
+        *db = all / num_clusters;
+        free(scatter);
+}
+
+// Dunn's index: for every ordered pair, a min dist between the two (the
+// first item of the first cluster only against the last of the other)
+// over the diameter of the first, summed
+static double legacy_dunns(const engine_t *e, int num_clusters, int div)
+{
+        float *diameter = alloc_mem(num_clusters, float);
+        float *between = alloc_mem((size_t)num_clusters * num_clusters, float);
+        float d, min = 0.0f, dunn, sum = 0.0f;
+        int i, j, ii, jj, item_i, item_j;
+        const nnode *p, *q;
+
+        if (!diameter || !between) {
+                alloc_fail("dunn's index");
+                free(diameter);
+                free(between);
+                return 0.0;
+        }
+        for (i = 0; i < num_clusters; i++) {
+                p = e->nodes[i];
+                item_j = p->first_item;
+                for (jj = 0; jj < p->num_items; jj++) {
+                        item_i = p->first_item;
+                        for (ii = 0; ii < p->num_items; ii++) {
+                                d = item_dist(e, item_i, item_j);
+                                if (jj == 0 || diameter[i] < d)
+                                        diameter[i] = d;
+                                item_i = e->next_item[item_i];
+                        }
+                        item_j = e->next_item[item_j];
+                }
+        }
+        for (i = 0; i < num_clusters; i++) {
+                between[i * num_clusters + i] = 0.0f;
+                for (j = i + 1; j < num_clusters; j++) {
+                        p = e->nodes[i];
+                        q = e->nodes[j];
+                        item_i = p->first_item;
+                        for (ii = 0; ii < p->num_items; ii++) {
+                                item_j = q->first_item;
+                                for (jj = 0; jj < q->num_items; jj++) {
+                                        d = item_dist(e, item_i, item_j);
+                                        if (ii == 0 || min > d)
+                                                min = d;
+                                        item_j = e->next_item[item_j];
+                                }
+                                item_i = e->next_item[item_i];
+                        }
+                        between[i * num_clusters + j] = min;
+                        between[j * num_clusters + i] = min;
+                }
+        }
+        for (i = 0; i < num_clusters; i++)
+                for (j = 0; j < num_clusters; j++) {
+                        d = between[i * num_clusters + j];
+                        if (div) {
+                                if (diameter[i] != 0)
+                                        sum += d / diameter[i];
+                                continue;
+                        }
+                        dunn = d / diameter[i];
+                        if (d == 0 || diameter[i] == 0)
+                                dunn = 0;
+                        sum += dunn;
+                }
+        free(diameter);
+        free(between);
+        return sum;
+}
+
+// separation: dists between centroids (an attribute whose square is over
+// 100 left out) added into a running total, which every cluster adds up
+static double legacy_sp(const float *cents, int num_clusters)
+{
+        float dist, all = 0.0f, sum, sp = 0.0f;
+        const float *ci, *cj;
+        int i, j, t;
+
+        for (i = 0; i < num_clusters; i++) {
+                ci = cents + i * NUM_ATTRS;
+                sum = 0.0f;
+                for (j = 0; j < num_clusters; j++) {
+                        if (i == j)
+                                continue;
+                        cj = cents + j * NUM_ATTRS;
+                        for (t = 0; t < NUM_ATTRS; t++) {
+                                dist = (ci[t] - cj[t]) * (ci[t] - cj[t]);
+                                if (dist > 100)
+                                        dist = 0.0f;
+                                all += sqrt(dist);
+                        }
+                        sum += all;
+                }
+                sum /= (num_clusters - 1);
+                sp += sum;
+        }
+        sp /= num_clusters;
+        return sp / num_clusters;
+}
+
+// silhouette: the dists inside and across clusters, in sums that go on
+// from one item to the next
+static double legacy_sc(const engine_t *e, int num_clusters)
+{
+        float *same = alloc_mem(e->num_items, float);
+        float *other = alloc_mem(e->num_items, float);
+        double same_sum = 0.0, other_sum = 0.0;
+        float all_sum = 0.0f, si = 0.0f, all, end = 0.0f;
+        int i, j, k, x, y, pos, item_i, item_j;
+        const nnode *p, *q;
+
+        if (!same || !other) {
+                alloc_fail("silhouette sums");
+                free(same);
+                free(other);
+                return 0.0;
+        }
+        for (i = 0, pos = 0; i < num_clusters; i++) {
+                p = e->nodes[i];
+                item_i = p->first_item;
+                for (x = 0; x < p->num_items; x++, pos++) {
+                        item_j = p->first_item;
+                        for (y = 0; y < p->num_items; y++) {
+                                same_sum += item_dist(e, item_i, item_j);
+                                item_j = e->next_item[item_j];
+                        }
+                        same_sum /= (p->num_items - 1);
+                        if (p->num_items == 1)
+                                same_sum = 0.0;
+                        same[pos] = same_sum;
+
+                        for (k = 0; k < num_clusters; k++) {
+                                q = e->nodes[k];
+                                item_j = q->first_item;
+                                if (k != i)
+                                        for (j = 0; j < q->num_items; j++) {
+                                                other_sum += item_dist(
+                                                        e, item_i, item_j);
+                                                item_j = e->next_item[item_j];
+                                        }
+                                other_sum /= q->num_items;
+                                all_sum += other_sum;
+                        }
+                        other[pos] = all_sum;
+                        item_i = e->next_item[item_i];
+                }
+        }
+        for (i = 0, pos = 0; i < num_clusters; i++) {
+                all = 0.0f;
+                for (x = 0; x < e->nodes[i]->num_items; x++, pos++) {
+                        if (same[pos] < other[pos])
+                                si = 1 - (same[pos] / other[pos]);
+                        if (same[pos] != 0 && other[pos] == 0)
+                                si = 0;
+                        if (same[pos] > other[pos])
+                                si = (other[pos] / same[pos]) - 1;
+                        all += si;
+                        all /= e->nodes[i]->num_items;
+                }
+                end += all;
+        }
+        end /= num_clusters;
+        free(same);
+        free(other);
+        return end;
+}
+
+static int legacy_report(const engine_t *e, int num_clusters, FILE *out,
+                         double *value)
+{
+        const legacy_copy *copy = e->copy;
+        float *cents = alloc_mem((size_t)num_clusters * NUM_ATTRS, float);
+        float qe;
+        double db;
+
+        if (!cents) {
+                alloc_fail("evaluation");
+                return -1;
+        }
+        legacy_centroid(e, num_clusters, cents);
+        legacy_qe(e, num_clusters, cents, copy->flags & LEGACY_DB_MAX, &qe,
+                  &db);
+        fprintf(out, "qe %f\n", qe);
+        trimat_advise(&e->item_distances, TRI_SWEEP);
+
+        value[EVAL_SKEW] = legacy_skew(e, num_clusters, copy->eval_items);
+        value[EVAL_QE] = qe / copy->eval_items;
+        value[EVAL_DB] = db;
+        value[EVAL_DUNN] = legacy_dunns(e, num_clusters,
+                                        copy->flags & LEGACY_DUNN_DIV);
+        value[EVAL_SP] = legacy_sp(cents, num_clusters);
+        value[EVAL_SC] = legacy_sc(e, num_clusters);
+        value[EVAL_DUNN_WIDTH] = e->policy.sel == SEL_ORIGINAL ? 6 : 0;
+        free(cents);
+        return 0;
+}
+
+// the values of the result in value[NUM_EVALS], and qe in out; -1 and
+// nothing if out of memory
+int eval_report(const engine_t *e, int num_clusters, FILE *out,
+                 double *value)
+{
+        int *cluster_of;
+        float *cents;
+        double qe, db;
+
+        if (e->legacy)
+                return legacy_report(e, num_clusters, out, value);
+        cluster_of = alloc_mem(e->num_items, int);
+        cents = alloc_mem((size_t)num_clusters * NUM_ATTRS, float);
+        if (!cluster_of || !cents) {
+                alloc_fail("evaluation");
+                free(cluster_of);
+                free(cents);
+                return -1;
+        }
+        eval_centroid(e, num_clusters, cluster_of, cents);
+        eval_qe(e, num_clusters, cluster_of, cents, &qe, &db);
+        fprintf(out, "qe %f\n", qe);
+        // dunns_index and eval_sc read item_distances row after row
+        trimat_advise(&e->item_distances, TRI_SWEEP);
+
+        value[EVAL_SKEW] = eval_skew(e, num_clusters);
+        value[EVAL_QE] = qe;
+        value[EVAL_DB] = db;
+        value[EVAL_DUNN] = dunns_index(e, cluster_of);
+        value[EVAL_SP] = eval_sp(cents, num_clusters);
+        value[EVAL_SC] = eval_sc(e, num_clusters, cluster_of);
+        value[EVAL_DUNN_WIDTH] = 0;
+        free(cluster_of);
+        free(cents);
+        return 0;
+}
+
+// value from eval_report, each to its file
+void eval_append(const double *value)
+{
+        static const char *const fname[EVAL_DUNN_WIDTH] = {
+                "skew.txt", "end.txt", "db.txt", "dunns.txt", "sp.txt",
+                "sc.txt"
+        };
+        int k;
+
+        for (k = 0; k < EVAL_DUNN_WIDTH; k++)
+                append_result(fname[k], value[k],
+                              k == EVAL_DUNN ? (int)value[EVAL_DUNN_WIDTH] : 0,
+                              k == EVAL_SKEW);
+}
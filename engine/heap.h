@@ -0,0 +1,124 @@
+/**
+ * Indexed binary min-heap over ids 0 .. n-1.
+ *
+ * Every id in the heap has a key; heap_update moves it up or down when
+ * the key changes and heap_remove drops it.  Equal keys are ordered by
+ * id, so heap_top is the smallest id among the smallest keys, the same
+ * one a linear scan in id order would pick.
+ */
+
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stdlib.h>
+
+typedef struct heap_s heap_t;
+struct heap_s {
+        int size;
+        int *ids;    /* heap order */
+        int *pos;    /* position of an id in ids, -1 if not in the heap */
+        float *key;  /* key by id */
+};
+
+static inline int heap_less(const heap_t *h, int a, int b)
+{
+        return h->key[a] < h->key[b] || (h->key[a] == h->key[b] && a < b);
+}
+
+static inline void heap_place(heap_t *h, int p, int id)
+{
+        h->ids[p] = id;
+        h->pos[id] = p;
+}
+
+static inline void heap_sift_up(heap_t *h, int p)
+{
+        int id = h->ids[p], parent;
+
+        while (p > 0) {
+                parent = (p - 1) / 2;
+                if (!heap_less(h, id, h->ids[parent]))
+                        break;
+                heap_place(h, p, h->ids[parent]);
+                p = parent;
+        }
+        heap_place(h, p, id);
+}
+
+static inline void heap_sift_down(heap_t *h, int p)
+{
+        int id = h->ids[p], child;
+
+        while ((child = 2 * p + 1) < h->size) {
+                if (child + 1 < h->size
+                    && heap_less(h, h->ids[child + 1], h->ids[child]))
+                        child++;
+                if (!heap_less(h, h->ids[child], id))
+                        break;
+                heap_place(h, p, h->ids[child]);
+                p = child;
+        }
+        heap_place(h, p, id);
+}
+
+static inline int heap_alloc(heap_t *h, int n)
+{
+        h->size = 0;
+        h->ids = (int *)malloc((n > 0 ? n : 1) * sizeof(int));
+        h->pos = (int *)malloc((n > 0 ? n : 1) * sizeof(int));
+        h->key = (float *)malloc((n > 0 ? n : 1) * sizeof(float));
+        return h->ids && h->pos && h->key ? 0 : -1;
+}
+
+static inline void heap_free(heap_t *h)
+{
+        free(h->ids);
+        free(h->pos);
+        free(h->key);
+        h->ids = h->pos = NULL;
+        h->key = NULL;
+        h->size = 0;
+}
+
+// key[0 .. n-1] already set; put every id into the heap
+static inline void heap_build(heap_t *h, int n)
+{
+        int p;
+
+        h->size = n;
+        for (p = 0; p < n; p++)
+                heap_place(h, p, p);
+        for (p = n / 2 - 1; p >= 0; p--)
+                heap_sift_down(h, p);
+}
+
+// new key of an id already in the heap
+static inline void heap_update(heap_t *h, int id, float key)
+{
+        float old = h->key[id];
+
+        h->key[id] = key;
+        if (key < old)
+                heap_sift_up(h, h->pos[id]);
+        else if (key > old)
+                heap_sift_down(h, h->pos[id]);
+}
+
+static inline void heap_remove(heap_t *h, int id)
+{
+        int p = h->pos[id], last = h->ids[--h->size];
+
+        h->pos[id] = -1;
+        if (p == h->size)
+                return;
+        heap_place(h, p, last);
+        heap_sift_up(h, p);
+        heap_sift_down(h, h->pos[last]);
+}
+
+static inline int heap_top(const heap_t *h)
+{
+        return h->ids[0];
+}
+
+#endif
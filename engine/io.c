@@ -0,0 +1,39 @@
+#include <string.h>
+
+#include "clust.h"
+
+// attribute-major copy of the items for the distance kernels
+int item_cols_alloc(item_cols *c, const item_t *items, int num_items)
+{
+        int i, t;
+        void *p;
+
+        c->n = num_items;
+        c->map = NULL;
+        c->mapped = 0;
+        c->ld = (num_items + 15) & ~15;
+        if (c->ld == 0)
+                c->ld = 16;
+        if (posix_memalign(&p, 64, (size_t)NUM_ATTRS * c->ld * sizeof(float))) {
+                c->col = NULL;
+                return -1;
+        }
+        c->col = p;
+        memset(c->col, 0, (size_t)NUM_ATTRS * c->ld * sizeof(float));
+        for (i = 0; i < num_items; i++)
+                for (t = 0; t < NUM_ATTRS; t++)
+                        c->col[(size_t)t * c->ld + i] = items[i].coord[t];
+        return 0;
+}
+
+void item_cols_free(item_cols *c)
+{
+        if (c->mapped)
+                col_unmap(c);
+        else
+                free(c->col);
+        c->col = NULL;
+        c->map = NULL;
+        c->mapped = 0;
+        c->n = c->ld = 0;
+}
@@ -0,0 +1,365 @@
+/**
+ * kd-tree for nearest-cluster queries over a set of items.
+ *
+ * Every point carries the id of the cluster it belongs to, and every node
+ * the cluster of all the points below it (-1 if they are mixed), so a
+ * query for the closest point of another cluster skips whole subtrees of
+ * its own cluster as well as those whose box is farther than the best
+ * point so far.
+ *
+ * Every node also keeps the largest cluster id below it, so a query for
+ * the closest point of a cluster after a given id (the nearest j > i of
+ * row i of clu_distances) skips the subtrees of smaller ids.
+ *
+ * Nodes are split at the median of their widest attribute down to
+ * KD_LEAF points; the points are kept point-major in slot order, so a
+ * leaf is one contiguous block.  Dists are squared, summed over the
+ * attributes in order like dist_row.
+ *
+ * kd_remove / kd_move keep the tree in step with merges whose reps are a
+ * subset of the two clusters': the point's slot is retagged and the
+ * nodes on its path fit again, from the leaf up, to the points left, so
+ * the boxes shrink and the subtrees of one cluster are found again as the
+ * clusters grow.  The shape of the tree stays as it was built.
+ */
+
+/* deeper than any tree of int slots split at the median */
+#define KD_MAX_DEPTH 64
+
+#include <float.h>
+#include <string.h>
+
+#include "clust.h"
+
+#define KD_LEAF 16
+
+static float *slot_pt(const kdtree *t, int s)
+{
+        return t->pt + (size_t)s * NUM_ATTRS;
+}
+
+static void swap_slots(kdtree *t, int a, int b)
+{
+        float tmp[NUM_ATTRS];
+        int i;
+
+        i = t->item[a];
+        t->item[a] = t->item[b];
+        t->item[b] = i;
+        i = t->owner[a];
+        t->owner[a] = t->owner[b];
+        t->owner[b] = i;
+        memcpy(tmp, slot_pt(t, a), sizeof(tmp));
+        memcpy(slot_pt(t, a), slot_pt(t, b), sizeof(tmp));
+        memcpy(slot_pt(t, b), tmp, sizeof(tmp));
+}
+
+// put the slot with the k-th smallest attribute dim at k, smaller before it
+static void select_slot(kdtree *t, int begin, int end, int k, int dim)
+{
+        int i, j;
+        float pivot;
+
+        while (end - begin > 1) {
+                pivot = slot_pt(t, begin + (end - begin) / 2)[dim];
+                i = begin;
+                j = end - 1;
+                while (i <= j) {
+                        while (slot_pt(t, i)[dim] < pivot)
+                                i++;
+                        while (slot_pt(t, j)[dim] > pivot)
+                                j--;
+                        if (i <= j)
+                                swap_slots(t, i++, j--);
+                }
+                if (k <= j)
+                        end = j + 1;
+                else if (k >= i)
+                        begin = i;
+                else
+                        return;
+        }
+}
+
+// box, cluster and count of the live slots of nd
+static void fit_slots(kdtree *t, kd_node *nd)
+{
+        int s, d;
+        const float *p;
+
+        nd->num_live = 0;
+        nd->owner = nd->max_owner = -1;
+        for (d = 0; d < NUM_ATTRS; d++) {
+                nd->lo[d] = FLT_MAX;
+                nd->hi[d] = -FLT_MAX;
+        }
+        for (s = nd->begin; s < nd->end; s++) {
+                if (t->owner[s] < 0)
+                        continue;
+                p = slot_pt(t, s);
+                for (d = 0; d < NUM_ATTRS; d++) {
+                        if (p[d] < nd->lo[d])
+                                nd->lo[d] = p[d];
+                        if (p[d] > nd->hi[d])
+                                nd->hi[d] = p[d];
+                }
+                if (nd->num_live++ == 0)
+                        nd->owner = t->owner[s];
+                else if (t->owner[s] != nd->owner)
+                        nd->owner = -1;
+                if (t->owner[s] > nd->max_owner)
+                        nd->max_owner = t->owner[s];
+        }
+}
+
+// the same from the two children of nd
+static void fit_children(kdtree *t, kd_node *nd)
+{
+        const kd_node *l = &t->node[nd->left], *r = &t->node[nd->right];
+        int d;
+
+        nd->num_live = l->num_live + r->num_live;
+        if (l->num_live == 0 || r->num_live == 0) {
+                if (l->num_live == 0)
+                        l = r;
+                memcpy(nd->lo, l->lo, sizeof(nd->lo));
+                memcpy(nd->hi, l->hi, sizeof(nd->hi));
+                nd->owner = l->owner;
+                nd->max_owner = l->max_owner;
+                return;
+        }
+        for (d = 0; d < NUM_ATTRS; d++) {
+                nd->lo[d] = l->lo[d] < r->lo[d] ? l->lo[d] : r->lo[d];
+                nd->hi[d] = l->hi[d] > r->hi[d] ? l->hi[d] : r->hi[d];
+        }
+        nd->owner = l->owner == r->owner ? l->owner : -1;
+        nd->max_owner = l->max_owner > r->max_owner ? l->max_owner
+                                                    : r->max_owner;
+}
+
+static int build_node(kdtree *t, int begin, int end)
+{
+        kd_node *nd = &t->node[t->num_nodes];
+        int id = t->num_nodes++, d, dim = 0, mid;
+        float width = -1.0f;
+
+        nd->begin = begin;
+        nd->end = end;
+        nd->left = nd->right = -1;
+        fit_slots(t, nd);
+        if (end - begin <= KD_LEAF)
+                return id;
+        for (d = 0; d < NUM_ATTRS; d++)
+                if (nd->hi[d] - nd->lo[d] > width) {
+                        width = nd->hi[d] - nd->lo[d];
+                        dim = d;
+                }
+        if (width <= 0.0f)
+                return id;     // all points equal: one leaf
+        mid = begin + (end - begin) / 2;
+        select_slot(t, begin, end, mid, dim);
+        nd->left = build_node(t, begin, mid);
+        nd->right = build_node(t, mid, end);
+        return id;
+}
+
+int kd_build(kdtree *t, const item_cols *c, const int *items,
+             const int *owners, int num)
+{
+        int s, d;
+
+        t->num = num;
+        t->num_nodes = 0;
+        t->num_ids = 1;
+        for (s = 0; s < num; s++)
+                if (items[s] >= t->num_ids)
+                        t->num_ids = items[s] + 1;
+        t->slot_of = alloc_mem(t->num_ids, int);
+        t->item = alloc_mem(num > 0 ? num : 1, int);
+        t->owner = alloc_mem(num > 0 ? num : 1, int);
+        t->pt = alloc_mem((size_t)(num > 0 ? num : 1) * NUM_ATTRS, float);
+        // only nodes over KD_LEAF points are split, at the median, so a
+        // leaf keeps at least KD_LEAF / 2 of them
+        t->node = alloc_mem(4 * (num / KD_LEAF) + 2, kd_node);
+        if (!t->item || !t->owner || !t->pt || !t->node || !t->slot_of) {
+                kd_free(t);
+                return -1;
+        }
+        for (s = 0; s < num; s++) {
+                t->item[s] = items[s];
+                t->owner[s] = owners[s];
+                for (d = 0; d < NUM_ATTRS; d++)
+                        slot_pt(t, s)[d] = c->col[(size_t)d * c->ld + items[s]];
+        }
+        if (num > 0)
+                build_node(t, 0, num);
+        for (s = 0; s < t->num_ids; s++)
+                t->slot_of[s] = -1;
+        for (s = 0; s < num; s++)
+                t->slot_of[t->item[s]] = s;
+        return 0;
+}
+
+// build t again from its live points only
+int kd_compact(kdtree *t, const item_cols *c)
+{
+        kdtree old = *t;
+        int s, num = 0;
+
+        for (s = 0; s < old.num; s++)
+                if (old.owner[s] >= 0) {
+                        old.item[num] = old.item[s];
+                        old.owner[num++] = old.owner[s];
+                }
+        s = kd_build(t, c, old.item, old.owner, num);
+        kd_free(&old);
+        return s;
+}
+
+void kd_free(kdtree *t)
+{
+        free(t->node);
+        free(t->item);
+        free(t->owner);
+        free(t->pt);
+        free(t->slot_of);
+        memset(t, 0, sizeof(*t));
+}
+
+// squared dist from q to the box of nd, 0 inside
+static float box_dist(const kd_node *nd, const float *q)
+{
+        int d;
+        float diff, dist = 0.0f;
+
+        for (d = 0; d < NUM_ATTRS; d++) {
+                if (q[d] < nd->lo[d])
+                        diff = nd->lo[d] - q[d];
+                else if (q[d] > nd->hi[d])
+                        diff = q[d] - nd->hi[d];
+                else
+                        continue;
+                dist += diff * diff;
+        }
+        return dist;
+}
+
+static void nearest_node(const kdtree *t, int id, const float *q,
+                         int above, int exclude, kd_hit *best)
+{
+        const kd_node *nd = &t->node[id];
+        int s, d, first, second;
+        float diff, dist;
+        const float *p;
+
+        if (nd->num_live == 0 || nd->owner == exclude
+            || nd->max_owner <= above || box_dist(nd, q) > best->dist)
+                return;
+        if (nd->left < 0) {
+                for (s = nd->begin; s < nd->end; s++) {
+                        if (t->owner[s] <= above || t->owner[s] == exclude)
+                                continue;
+                        p = slot_pt(t, s);
+                        dist = 0.0f;
+                        for (d = 0; d < NUM_ATTRS; d++) {
+                                diff = q[d] - p[d];
+                                dist += diff * diff;
+                        }
+                        if (dist > best->dist)
+                                continue;
+                        if (dist < best->dist)
+                                best->tied = 0;
+                        else if (t->owner[s] != best->owner)
+                                best->tied = 1;
+                        // ties to the smaller cluster id, then item
+                        if (dist < best->dist || t->owner[s] < best->owner
+                            || (t->owner[s] == best->owner
+                                && t->item[s] < best->item)) {
+                                best->dist = dist;
+                                best->item = t->item[s];
+                                best->owner = t->owner[s];
+                        }
+                }
+                return;
+        }
+        // the nearer child first, so the other one is more likely pruned
+        first = nd->left;
+        second = nd->right;
+        if (box_dist(&t->node[second], q) < box_dist(&t->node[first], q)) {
+                first = nd->right;
+                second = nd->left;
+        }
+        nearest_node(t, first, q, above, exclude, best);
+        nearest_node(t, second, q, above, exclude, best);
+}
+
+// closest point to q outside cluster exclude, if closer than *best; a
+// point of yet another cluster at the same dist sets best->tied
+void kd_nearest(const kdtree *t, const float *q, int exclude, kd_hit *best)
+{
+        if (t->num_nodes > 0)
+                nearest_node(t, 0, q, -1, exclude, best);
+}
+
+// the same among the clusters after above only
+void kd_nearest_above(const kdtree *t, const float *q, int above,
+                      int exclude, kd_hit *best)
+{
+        if (t->num_nodes > 0)
+                nearest_node(t, 0, q, above, exclude, best);
+}
+
+// slot s now belongs to cluster owner (-1: removed); fit the nodes on its
+// path again, from the leaf up
+static void retag_slot(kdtree *t, int s, int owner)
+{
+        int path[KD_MAX_DEPTH], depth = 0, id = 0;
+        kd_node *nd;
+
+        t->owner[s] = owner;
+        while (id >= 0) {
+                path[depth++] = id;
+                nd = &t->node[id];
+                if (nd->left < 0)
+                        id = -1;
+                else
+                        id = s < t->node[nd->left].end ? nd->left : nd->right;
+        }
+        fit_slots(t, &t->node[path[--depth]]);
+        while (depth > 0)
+                fit_children(t, &t->node[path[--depth]]);
+}
+
+// slot of item if it is a live point of t, else -1
+static int live_slot(const kdtree *t, int item)
+{
+        int s = item < t->num_ids ? t->slot_of[item] : -1;
+
+        return s >= 0 && t->owner[s] >= 0 ? s : -1;
+}
+
+void kd_remove(kdtree *t, int item)
+{
+        int s = live_slot(t, item);
+
+        if (s >= 0)
+                retag_slot(t, s, -1);
+}
+
+// item now belongs to cluster owner
+void kd_move(kdtree *t, int item, int owner)
+{
+        int s = live_slot(t, item);
+
+        if (s >= 0)
+                retag_slot(t, s, owner);
+}
+
+// item, removed before, is a point of cluster owner again
+void kd_insert(kdtree *t, int item, int owner)
+{
+        int s = item < t->num_ids ? t->slot_of[item] : -1;
+
+        if (s >= 0)
+                retag_slot(t, s, owner);
+}
@@ -0,0 +1,487 @@
+/**
+ * Squared Euclidean distance kernels, picked at run time by CPUID.
+ *
+ * Both inputs are attribute-major: the item columns (item_cols, clust.h)
+ * and the rep coordinate blocks of the rep slab (repslab.h), so one SIMD
+ * register holds the same attribute of 4 (SSE2), 8 (AVX2) or 16 (AVX-512)
+ * items, and the other side is broadcast against them.
+ *
+ *   dist_row    out[j - j0] = dist(i, j) for j0 <= j < j1; builds
+ *               item_distances
+ *   rep_minmax  closest and farthest rep pair of two clusters; link_dist
+ *   rep_dists   out[j] = dist(x, rep j of b) for one point x
+ *   diff_tile   TILE_ROWS x (j1 - j0) dists, summed on over attributes
+ *               t0 .. t1; the micro-kernel of the blocked builder in tile.c
+ *
+ * Every lane sums (x_j - x_i)^2 over the attributes in the same order as
+ * the scalar loop, with a separate multiply and add, so all ISAs give the
+ * same floats and item_distances agrees with what link_dist computes.
+ * The AVX-512 target implies FMA; contraction is turned off for this file
+ * so the compiler does not fuse the multiply and add behind our back.
+ */
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#include <float.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#include "clust.h"
+
+static void dist_row_scalar(const item_cols *c, int i, int j0, int j1,
+                            float *out)
+{
+        int j;
+        size_t t;      /* t * ld can pass INT_MAX */
+        float diff, dist;
+
+        for (j = j0; j < j1; j++) {
+                dist = 0.0f;
+                for (t = 0; t < NUM_ATTRS; t++) {
+                        diff = c->col[t * c->ld + i] - c->col[t * c->ld + j];
+                        dist += diff * diff;
+                }
+                out[j - j0] = dist;
+        }
+}
+
+// reps j0 .. kb-1 of b against all reps of a; min / max accumulate
+static void rep_minmax_tail(const float *a, int lda, int ka,
+                            const float *b, int ldb, int j0, int kb,
+                            float *mindist, float *maxdist)
+{
+        int i, j, t;
+        float diff, dist;
+
+        for (i = 0; i < ka; i++) {
+                for (j = j0; j < kb; j++) {
+                        dist = 0.0f;
+                        for (t = 0; t < NUM_ATTRS; t++) {
+                                diff = a[t * lda + i] - b[t * ldb + j];
+                                dist += diff * diff;
+                        }
+                        if (dist < *mindist)
+                                *mindist = dist;
+                        if (dist > *maxdist)
+                                *maxdist = dist;
+                }
+        }
+}
+
+static void rep_dists_scalar(const float *x, int ldx,
+                             const float *b, int ldb, int kb, float *out)
+{
+        int j, t;
+        float diff, dist;
+
+        for (j = 0; j < kb; j++) {
+                dist = 0.0f;
+                for (t = 0; t < NUM_ATTRS; t++) {
+                        diff = x[t * ldx] - b[t * ldb + j];
+                        dist += diff * diff;
+                }
+                out[j] = dist;
+        }
+}
+
+static void rep_minmax_scalar(const float *a, int lda, int ka,
+                              const float *b, int ldb, int kb,
+                              float *mindist, float *maxdist)
+{
+        *mindist = FLT_MAX;
+        *maxdist = 0.0f;
+        rep_minmax_tail(a, lda, ka, b, ldb, 0, kb, mindist, maxdist);
+}
+
+// row i0 + r of a tile, or -1 past the last row
+static int tile_row(int i0, int ni, int r)
+{
+        return r < ni ? i0 + r : -1;
+}
+
+static void diff_tile_scalar(const item_cols *c, int i0, int ni,
+                             int j0, int j1, int t0, int t1,
+                             float *acc, int ldacc)
+{
+        int r, j, t;
+        float a, diff;
+
+        for (r = 0; r < ni; r++)
+                for (t = t0; t < t1; t++) {
+                        a = c->col[(size_t)t * c->ld + i0 + r];
+                        for (j = j0; j < j1; j++) {
+                                diff = a - c->col[(size_t)t * c->ld + j];
+                                acc[r * ldacc + j - j0] += diff * diff;
+                        }
+                }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* SSE2 */
+
+__attribute__((target("sse2")))
+static void dist_row_sse2(const item_cols *c, int i, int j0, int j1,
+                          float *out)
+{
+        __m128 sum, diff;
+        int j;
+        size_t t;
+
+        for (j = j0; j + 4 <= j1; j += 4) {
+                sum = _mm_setzero_ps();
+                for (t = 0; t < NUM_ATTRS; t++) {
+                        diff = _mm_sub_ps(_mm_set1_ps(c->col[t * c->ld + i]),
+                                          _mm_loadu_ps(c->col + t * c->ld + j));
+                        sum = _mm_add_ps(sum, _mm_mul_ps(diff, diff));
+                }
+                _mm_storeu_ps(out + (j - j0), sum);
+        }
+        dist_row_scalar(c, i, j, j1, out + (j - j0));
+}
+
+__attribute__((target("sse2")))
+static void rep_minmax_sse2(const float *a, int lda, int ka,
+                            const float *b, int ldb, int kb,
+                            float *mindist, float *maxdist)
+{
+        __m128 vmin = _mm_set1_ps(FLT_MAX), vmax = _mm_setzero_ps();
+        __m128 sum, diff;
+        float lanes[4];
+        int i, j, t;
+
+        for (j = 0; j + 4 <= kb; j += 4) {
+                for (i = 0; i < ka; i++) {
+                        sum = _mm_setzero_ps();
+                        for (t = 0; t < NUM_ATTRS; t++) {
+                                diff = _mm_sub_ps(_mm_set1_ps(a[t * lda + i]),
+                                                  _mm_loadu_ps(b + t * ldb + j));
+                                sum = _mm_add_ps(sum, _mm_mul_ps(diff, diff));
+                        }
+                        vmin = _mm_min_ps(vmin, sum);
+                        vmax = _mm_max_ps(vmax, sum);
+                }
+        }
+        vmin = _mm_min_ps(vmin, _mm_movehl_ps(vmin, vmin));
+        _mm_storeu_ps(lanes, vmin);
+        *mindist = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+        vmax = _mm_max_ps(vmax, _mm_movehl_ps(vmax, vmax));
+        _mm_storeu_ps(lanes, vmax);
+        *maxdist = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+        rep_minmax_tail(a, lda, ka, b, ldb, j, kb, mindist, maxdist);
+}
+
+__attribute__((target("sse2")))
+static void diff_tile_sse2(const item_cols *c, int i0, int ni,
+                           int j0, int j1, int t0, int t1,
+                           float *acc, int ldacc)
+{
+        __m128 sum[TILE_ROWS], b, diff;
+        const float *col;
+        int r, j, t, row[TILE_ROWS];
+
+        for (r = 0; r < TILE_ROWS; r++)
+                row[r] = tile_row(i0, ni, r);
+        for (j = j0; j + 4 <= j1; j += 4) {
+                for (r = 0; r < TILE_ROWS; r++)
+                        sum[r] = row[r] >= 0 ? _mm_loadu_ps(acc + r * ldacc + j - j0)
+                                             : _mm_setzero_ps();
+                for (t = t0; t < t1; t++) {
+                        col = c->col + (size_t)t * c->ld;
+                        b = _mm_loadu_ps(col + j);
+                        for (r = 0; r < TILE_ROWS; r++)
+                                if (row[r] >= 0) {
+                                        diff = _mm_sub_ps(_mm_set1_ps(col[row[r]]), b);
+                                        sum[r] = _mm_add_ps(sum[r], _mm_mul_ps(diff, diff));
+                                }
+                }
+                for (r = 0; r < ni; r++)
+                        _mm_storeu_ps(acc + r * ldacc + j - j0, sum[r]);
+        }
+        if (j < j1)
+                diff_tile_scalar(c, i0, ni, j, j1, t0, t1, acc + j - j0, ldacc);
+}
+
+__attribute__((target("sse2")))
+static void rep_dists_sse2(const float *x, int ldx,
+                           const float *b, int ldb, int kb, float *out)
+{
+        __m128 sum, diff;
+        int j, t;
+
+        for (j = 0; j + 4 <= kb; j += 4) {
+                sum = _mm_setzero_ps();
+                for (t = 0; t < NUM_ATTRS; t++) {
+                        diff = _mm_sub_ps(_mm_set1_ps(x[t * ldx]),
+                                          _mm_loadu_ps(b + t * ldb + j));
+                        sum = _mm_add_ps(sum, _mm_mul_ps(diff, diff));
+                }
+                _mm_storeu_ps(out + j, sum);
+        }
+        if (j < kb)
+                rep_dists_scalar(x, ldx, b + j, ldb, kb - j, out + j);
+}
+
+/* AVX2 */
+
+__attribute__((target("avx2")))
+static void dist_row_avx2(const item_cols *c, int i, int j0, int j1,
+                          float *out)
+{
+        __m256 sum, diff;
+        int j;
+        size_t t;
+
+        for (j = j0; j + 8 <= j1; j += 8) {
+                sum = _mm256_setzero_ps();
+                for (t = 0; t < NUM_ATTRS; t++) {
+                        diff = _mm256_sub_ps(_mm256_set1_ps(c->col[t * c->ld + i]),
+                                             _mm256_loadu_ps(c->col + t * c->ld + j));
+                        sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+                }
+                _mm256_storeu_ps(out + (j - j0), sum);
+        }
+        dist_row_scalar(c, i, j, j1, out + (j - j0));
+}
+
+__attribute__((target("avx2")))
+static void rep_minmax_avx2(const float *a, int lda, int ka,
+                            const float *b, int ldb, int kb,
+                            float *mindist, float *maxdist)
+{
+        __m256 vmin = _mm256_set1_ps(FLT_MAX), vmax = _mm256_setzero_ps();
+        __m256 sum, diff;
+        __m128 lo;
+        int i, j, t;
+
+        for (j = 0; j + 8 <= kb; j += 8) {
+                for (i = 0; i < ka; i++) {
+                        sum = _mm256_setzero_ps();
+                        for (t = 0; t < NUM_ATTRS; t++) {
+                                diff = _mm256_sub_ps(_mm256_set1_ps(a[t * lda + i]),
+                                                     _mm256_loadu_ps(b + t * ldb + j));
+                                sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+                        }
+                        vmin = _mm256_min_ps(vmin, sum);
+                        vmax = _mm256_max_ps(vmax, sum);
+                }
+        }
+        lo = _mm_min_ps(_mm256_castps256_ps128(vmin), _mm256_extractf128_ps(vmin, 1));
+        lo = _mm_min_ps(lo, _mm_movehl_ps(lo, lo));
+        *mindist = _mm_cvtss_f32(_mm_min_ss(lo, _mm_movehdup_ps(lo)));
+        lo = _mm_max_ps(_mm256_castps256_ps128(vmax), _mm256_extractf128_ps(vmax, 1));
+        lo = _mm_max_ps(lo, _mm_movehl_ps(lo, lo));
+        *maxdist = _mm_cvtss_f32(_mm_max_ss(lo, _mm_movehdup_ps(lo)));
+        rep_minmax_tail(a, lda, ka, b, ldb, j, kb, mindist, maxdist);
+}
+
+__attribute__((target("avx2")))
+static void diff_tile_avx2(const item_cols *c, int i0, int ni,
+                           int j0, int j1, int t0, int t1,
+                           float *acc, int ldacc)
+{
+        __m256 sum[TILE_ROWS], b, diff;
+        const float *col;
+        int r, j, t, row[TILE_ROWS];
+
+        for (r = 0; r < TILE_ROWS; r++)
+                row[r] = tile_row(i0, ni, r);
+        for (j = j0; j + 8 <= j1; j += 8) {
+                for (r = 0; r < TILE_ROWS; r++)
+                        sum[r] = row[r] >= 0 ? _mm256_loadu_ps(acc + r * ldacc + j - j0)
+                                             : _mm256_setzero_ps();
+                for (t = t0; t < t1; t++) {
+                        col = c->col + (size_t)t * c->ld;
+                        b = _mm256_loadu_ps(col + j);
+                        for (r = 0; r < TILE_ROWS; r++)
+                                if (row[r] >= 0) {
+                                        diff = _mm256_sub_ps(_mm256_set1_ps(col[row[r]]), b);
+                                        sum[r] = _mm256_add_ps(sum[r], _mm256_mul_ps(diff, diff));
+                                }
+                }
+                for (r = 0; r < ni; r++)
+                        _mm256_storeu_ps(acc + r * ldacc + j - j0, sum[r]);
+        }
+        if (j < j1)
+                diff_tile_scalar(c, i0, ni, j, j1, t0, t1, acc + j - j0, ldacc);
+}
+
+__attribute__((target("avx2")))
+static void rep_dists_avx2(const float *x, int ldx,
+                           const float *b, int ldb, int kb, float *out)
+{
+        __m256 sum, diff;
+        int j, t;
+
+        for (j = 0; j + 8 <= kb; j += 8) {
+                sum = _mm256_setzero_ps();
+                for (t = 0; t < NUM_ATTRS; t++) {
+                        diff = _mm256_sub_ps(_mm256_set1_ps(x[t * ldx]),
+                                             _mm256_loadu_ps(b + t * ldb + j));
+                        sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+                }
+                _mm256_storeu_ps(out + j, sum);
+        }
+        if (j < kb)
+                rep_dists_scalar(x, ldx, b + j, ldb, kb - j, out + j);
+}
+
+/* AVX-512: masked tails, no scalar loop */
+
+__attribute__((target("avx512f")))
+static void dist_row_avx512(const item_cols *c, int i, int j0, int j1,
+                            float *out)
+{
+        __m512 sum, diff;
+        __mmask16 m;
+        int j;
+        size_t t;
+
+        for (j = j0; j < j1; j += 16) {
+                m = j1 - j >= 16 ? (__mmask16)0xffff
+                                 : (__mmask16)((1u << (j1 - j)) - 1);
+                sum = _mm512_setzero_ps();
+                for (t = 0; t < NUM_ATTRS; t++) {
+                        diff = _mm512_sub_ps(_mm512_set1_ps(c->col[t * c->ld + i]),
+                                             _mm512_maskz_loadu_ps(m, c->col + t * c->ld + j));
+                        sum = _mm512_add_ps(sum, _mm512_mul_ps(diff, diff));
+                }
+                _mm512_mask_storeu_ps(out + (j - j0), m, sum);
+        }
+}
+
+__attribute__((target("avx512f")))
+static void rep_minmax_avx512(const float *a, int lda, int ka,
+                              const float *b, int ldb, int kb,
+                              float *mindist, float *maxdist)
+{
+        __m512 vmin = _mm512_set1_ps(FLT_MAX), vmax = _mm512_setzero_ps();
+        __m512 sum, diff;
+        __mmask16 m;
+        int i, j, t;
+
+        for (j = 0; j < kb; j += 16) {
+                m = kb - j >= 16 ? (__mmask16)0xffff
+                                 : (__mmask16)((1u << (kb - j)) - 1);
+                for (i = 0; i < ka; i++) {
+                        sum = _mm512_setzero_ps();
+                        for (t = 0; t < NUM_ATTRS; t++) {
+                                diff = _mm512_sub_ps(_mm512_set1_ps(a[t * lda + i]),
+                                                     _mm512_maskz_loadu_ps(m, b + t * ldb + j));
+                                sum = _mm512_add_ps(sum, _mm512_mul_ps(diff, diff));
+                        }
+                        vmin = _mm512_mask_min_ps(vmin, m, vmin, sum);
+                        vmax = _mm512_mask_max_ps(vmax, m, vmax, sum);
+                }
+        }
+        *mindist = _mm512_reduce_min_ps(vmin);
+        *maxdist = _mm512_reduce_max_ps(vmax);
+}
+
+__attribute__((target("avx512f")))
+static void diff_tile_avx512(const item_cols *c, int i0, int ni,
+                             int j0, int j1, int t0, int t1,
+                             float *acc, int ldacc)
+{
+        __m512 sum[TILE_ROWS], b, diff;
+        __mmask16 m;
+        const float *col;
+        int r, j, t, row[TILE_ROWS];
+
+        for (r = 0; r < TILE_ROWS; r++)
+                row[r] = tile_row(i0, ni, r);
+        for (j = j0; j < j1; j += 16) {
+                m = j1 - j >= 16 ? (__mmask16)0xffff
+                                 : (__mmask16)((1u << (j1 - j)) - 1);
+                for (r = 0; r < TILE_ROWS; r++)
+                        sum[r] = row[r] >= 0
+                                 ? _mm512_maskz_loadu_ps(m, acc + r * ldacc + j - j0)
+                                 : _mm512_setzero_ps();
+                for (t = t0; t < t1; t++) {
+                        col = c->col + (size_t)t * c->ld;
+                        b = _mm512_maskz_loadu_ps(m, col + j);
+                        for (r = 0; r < TILE_ROWS; r++)
+                                if (row[r] >= 0) {
+                                        diff = _mm512_sub_ps(_mm512_set1_ps(col[row[r]]), b);
+                                        sum[r] = _mm512_add_ps(sum[r], _mm512_mul_ps(diff, diff));
+                                }
+                }
+                for (r = 0; r < ni; r++)
+                        _mm512_mask_storeu_ps(acc + r * ldacc + j - j0, m, sum[r]);
+        }
+}
+
+__attribute__((target("avx512f")))
+static void rep_dists_avx512(const float *x, int ldx,
+                             const float *b, int ldb, int kb, float *out)
+{
+        __m512 sum, diff;
+        __mmask16 m;
+        int j, t;
+
+        for (j = 0; j < kb; j += 16) {
+                m = kb - j >= 16 ? (__mmask16)0xffff
+                                 : (__mmask16)((1u << (kb - j)) - 1);
+                sum = _mm512_setzero_ps();
+                for (t = 0; t < NUM_ATTRS; t++) {
+                        diff = _mm512_sub_ps(_mm512_set1_ps(x[t * ldx]),
+                                             _mm512_maskz_loadu_ps(m, b + t * ldb + j));
+                        sum = _mm512_add_ps(sum, _mm512_mul_ps(diff, diff));
+                }
+                _mm512_mask_storeu_ps(out + j, m, sum);
+        }
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+static const dist_kernels kernel_table[] = {
+#ifdef HAVE_X86_KERNELS
+        { "avx512", dist_row_avx512, rep_minmax_avx512, diff_tile_avx512,
+          rep_dists_avx512 },
+        { "avx2", dist_row_avx2, rep_minmax_avx2, diff_tile_avx2,
+          rep_dists_avx2 },
+        { "sse2", dist_row_sse2, rep_minmax_sse2, diff_tile_sse2,
+          rep_dists_sse2 },
+#endif
+        { "scalar", dist_row_scalar, rep_minmax_scalar, diff_tile_scalar,
+          rep_dists_scalar },
+};
+
+static int cpu_has(const char *name)
+{
+#ifdef HAVE_X86_KERNELS
+        __builtin_cpu_init();
+        if (!strcmp(name, "avx512"))
+                return __builtin_cpu_supports("avx512f");
+        if (!strcmp(name, "avx2"))
+                return __builtin_cpu_supports("avx2");
+        if (!strcmp(name, "sse2"))
+                return __builtin_cpu_supports("sse2");
+#endif
+        return !strcmp(name, "scalar");
+}
+
+// the widest kernels the cpu runs; name limits them to that set or a
+// narrower one (NULL: no limit).  NULL if name is unknown.
+const dist_kernels *select_kernels(const char *name)
+{
+        size_t i, first = 0, num = sizeof(kernel_table) / sizeof(kernel_table[0]);
+
+        if (name) {
+                for (first = 0; first < num; first++)
+                        if (!strcmp(kernel_table[first].name, name))
+                                break;
+                if (first == num)
+                        return NULL;
+        }
+        for (i = first; i < num; i++)
+                if (cpu_has(kernel_table[i].name))
+                        return &kernel_table[i];
+        return &kernel_table[num - 1];
+}
@@ -0,0 +1,610 @@
+/**
+ * The original programs, merge for merge: what main.c runs by default
+ * (-f legacy).
+ *
+ * The copies under 固定式代表點/ and 變動式代表點/ are more than their
+ * four policy axes.  They keep the reps of a cluster in its place of
+ * nodes[] and read them back from there; the 散佈 ones rank reps in
+ * arrays that still hold, past the count of this merge, what an earlier
+ * merge wrote; Sc / fSc take the reps of the other cluster one at a time
+ * and keep only the last; and some copies were edited by hand: another
+ * k, another first dataset, another item count in skew and qe, another
+ * db or Dunn's sum (copies[] below).  This file redoes their loop with
+ * all of that, so the result files come out byte for byte; -f fixed runs
+ * cluster.c, which does what the copies meant to do.
+ *
+ * The matrices are the id-indexed triangles of cluster.c, filled with the
+ * item dists as they were.  smallest_dist and the heap are by place
+ * instead: row s is the cluster in nodes[s], its nearest is a place after
+ * s, and the heap keeps places 0 .. num_clusters_remaining-2 keyed on the
+ * cell the scan of the original compares, so heap_top is the place that
+ * scan stops at.  A NaN cell (0 / 0 in fSc) never wins that scan, so it
+ * is keyed as +inf.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "clust.h"
+#include "policy.h"
+
+/* fewer live clusters than this and the links of a merge stay on one
+   thread */
+#define PARALLEL_MIN_LINKS 256
+
+static const legacy_copy copies[] = {
+        // 固定式代表點/散佈/各群中心選取代表點, fSc: only 24.txt .. 30.txt
+        { { REP_FIXED, SEL_CENTER, SPREAD_SCATTERED, LINK_FSC },
+          8, 24, 207, 9, 0 },
+        { { REP_FIXED, SEL_CENTER_MIN, SPREAD_SCATTERED, LINK_SINGLE },
+          8, 1, 207, 9, LEGACY_DB_MAX },
+        { { REP_FIXED, SEL_ORIGINAL, SPREAD_CONCENTRATED, LINK_SINGLE },
+          5, 1, 6956, 179, LEGACY_DUNN_DIV },
+        { { REP_FIXED, SEL_CENTER_MIN, SPREAD_CONCENTRATED, LINK_SC },
+          8, 1, 207, 9, LEGACY_MIN_BY_B },
+        { { REP_SQRT, SEL_CENTER, SPREAD_SCATTERED, LINK_FSC },
+          5, 1, 5626, 33, 0 },
+        { { REP_SQRT, SEL_CENTER, SPREAD_SCATTERED, LINK_SINGLE },
+          5, 1, 5626, 33, 0 },
+        { { REP_SQRT, SEL_CENTER_MIN, SPREAD_SCATTERED, LINK_SINGLE },
+          8, 1, 207, 9, LEGACY_DB_MAX },
+        { { REP_SQRT, SEL_CENTER_MIN, SPREAD_CONCENTRATED, LINK_FSC },
+          5, 1, 5626, 33, 0 },
+        { { REP_SQRT, SEL_AVG_AFTER, SPREAD_CONCENTRATED, LINK_SINGLE },
+          3, 1, 1424, 10, 0 },
+};
+
+/* every other copy: k = 8 on 1.txt .. 30.txt of 207 items, 9 attrs */
+static const legacy_copy plain_copy = {
+        { REP_FIXED, SEL_ORIGINAL, SPREAD_CONCENTRATED, LINK_SINGLE },
+        8, 1, 207, 9, 0
+};
+
+// the copy of the original programs with this policy
+const legacy_copy *legacy_copy_of(const policy_t *policy)
+{
+        size_t i;
+
+        for (i = 0; i < sizeof(copies) / sizeof(copies[0]); i++)
+                if (copies[i].policy.rep == policy->rep
+                    && copies[i].policy.sel == policy->sel
+                    && copies[i].policy.spread == policy->spread
+                    && copies[i].policy.link == policy->link)
+                        return &copies[i];
+        return &plain_copy;
+}
+
+// room for k reps in both arrays of c; new room reads as item 0
+static void carry_reserve(legacy_carry *c, int k)
+{
+        int *a, *b;
+
+        if (k <= c->cap)
+                return;
+        a = realloc(c->item_a, k * sizeof(int));
+        if (a)
+                c->item_a = a;
+        b = realloc(c->item_b, k * sizeof(int));
+        if (b)
+                c->item_b = b;
+        if (!a || !b) {
+                alloc_fail("choose carry");
+                exit(1);
+        }
+        memset(a + c->cap, 0, (k - c->cap) * sizeof(int));
+        memset(b + c->cap, 0, (k - c->cap) * sizeof(int));
+        c->cap = k;
+}
+
+void legacy_carry_free(legacy_carry *c)
+{
+        free(c->item_a);
+        free(c->item_b);
+        memset(c, 0, sizeof(*c));
+}
+
+// an item left in the carry by a bigger dataset is past this one: item 0,
+// as if the carry were new
+static inline int carry_item(const engine_t *e, int item)
+{
+        return item < e->num_items ? item : 0;
+}
+
+// out[i] = closest of the m reps y to rep x[i], the first one taken as is
+static void cross_min(const engine_t *e, const int *x, int k, const int *y,
+                      int m, float *out)
+{
+        int i, j;
+        float d;
+
+        for (i = 0; i < k; i++)
+                for (j = 0; j < m; j++) {
+                        d = item_dist(e, x[i], y[j]);
+                        if (j == 0 || out[i] > d)
+                                out[i] = d;
+                }
+}
+
+// out[i] += dist from rep x[i] to each of the m reps y, in order
+static void cross_sum(const engine_t *e, const int *x, int k, const int *y,
+                      int m, float *out)
+{
+        int i, j;
+
+        for (i = 0; i < k; i++)
+                for (j = 0; j < m; j++)
+                        out[i] += item_dist(e, x[i], y[j]);
+}
+
+// the first num places of the exchange sort of the original over key[0 ..
+// k), item along: place i takes the first smaller key after it, again and
+// again, which is not stable, so it is done as it was
+static void sort_prefix(float *key, int *item, int k, int num)
+{
+        int i, j, t;
+        float f;
+
+        for (i = 0; i < num && i < k; i++)
+                for (j = i; j < k; j++)
+                        if (key[j] < key[i]) {
+                                f = key[j];
+                                key[j] = key[i];
+                                key[i] = f;
+                                t = item[j];
+                                item[j] = item[i];
+                                item[i] = t;
+                        }
+}
+
+// 散佈: the best of each side, by a quota that can run past the ka / kb
+// reps ranked now into the carry
+static int spread_choose(engine_t *e, const int *a, int ka, const int *b,
+                         int kb, int size_a, int size_b, int k, float *key,
+                         int *both, int *rep)
+{
+        legacy_carry *c = e->carry;
+        float *ka_key = key, *kb_key = key + ka;
+        double fa = floor(sqrt((double)size_a));
+        double fb = floor(sqrt((double)size_b));
+        int i, o, aitem, bitem, xxx;
+
+        memset(key, 0, (ka + kb) * sizeof(float));
+        switch (e->policy.sel) {
+        case SEL_ORIGINAL:
+                cross_min(e, a, ka, b, kb, ka_key);
+                cross_min(e, b, kb, a, ka, kb_key);
+                break;
+        case SEL_CENTER_MIN:
+                cross_min(e, a, ka, b, kb, ka_key);
+                cross_min(e, b, kb, a, ka, kb_key);
+                cross_sum(e, a, ka, a, ka, ka_key);
+                cross_sum(e, b, kb, b, kb, kb_key);
+                break;
+        case SEL_CENTER:
+                cross_sum(e, a, ka, a, ka, ka_key);
+                cross_sum(e, b, kb, b, kb, kb_key);
+                break;
+        case SEL_AVG_BEFORE:
+                cross_sum(e, a, ka, b, kb, ka_key);
+                cross_sum(e, b, kb, a, ka, kb_key);
+                break;
+        default:
+                // both sides against the first reps of the union, a first
+                memcpy(both, a, ka * sizeof(int));
+                memcpy(both + ka, b, kb * sizeof(int));
+                cross_sum(e, a, ka, both, ka, ka_key);
+                cross_sum(e, b, kb, both, kb, kb_key);
+                break;
+        }
+
+        aitem = (int)round(floor(sqrt((double)(size_a + size_b))) * fa
+                           / (fa + fb));
+        bitem = (int)round(floor(sqrt((double)(aitem + size_b))) * fb
+                           / (floor(sqrt((double)aitem)) + fb));
+        xxx = (int)floor(sqrt((double)(aitem + bitem)));
+        if (aitem == bitem)
+                aitem = (xxx + 1) / 2;
+
+        carry_reserve(c, ka > kb ? (ka > k ? ka : k) : (kb > k ? kb : k));
+        memcpy(c->item_a, a, ka * sizeof(int));
+        memcpy(c->item_b, b, kb * sizeof(int));
+        // sorted all the way: a later call can read them past its count
+        sort_prefix(ka_key, c->item_a, ka, ka);
+        sort_prefix(kb_key, c->item_b, kb, kb);
+        for (i = 0, o = 0; i < k; i++)
+                rep[i] = carry_item(e, i < aitem ? c->item_a[i]
+                                                 : c->item_b[o++]);
+        return k;
+}
+
+// 集中 原始代表點: the rep pairs across, closest first, the rep of best_a
+// and then of best_b of each, every rep once.  The sort goes only as far
+// as the pairs that give the k reps.
+static int conc_orig(engine_t *e, const int *a, int ka, const int *b,
+                     int kb, int k, float *dist, int *pa, int *pb,
+                     char *seen, int *rep)
+{
+        int i, j, t, x, num = ka * kb, got = 0;
+        float f;
+
+        for (j = 0, x = 0; j < kb; j++)
+                for (i = 0; i < ka; i++, x++) {
+                        dist[x] = item_dist(e, a[i], b[j]);
+                        pa[x] = i;
+                        pb[x] = j;
+                }
+        memset(seen, 0, ka + kb);
+        for (i = 0; i < num && got < k; i++) {
+                for (j = i; j < num; j++)
+                        if (dist[j] < dist[i]) {
+                                f = dist[j];
+                                dist[j] = dist[i];
+                                dist[i] = f;
+                                t = pa[j];
+                                pa[j] = pa[i];
+                                pa[i] = t;
+                                t = pb[j];
+                                pb[j] = pb[i];
+                                pb[i] = t;
+                        }
+                if (!seen[pa[i]]) {
+                        seen[pa[i]] = 1;
+                        rep[got++] = a[pa[i]];
+                }
+                if (got < k && !seen[ka + pb[i]]) {
+                        seen[ka + pb[i]] = 1;
+                        rep[got++] = b[pb[i]];
+                }
+        }
+        return got;
+}
+
+// 集中: a key for every rep of both, the k smallest of the union
+static int conc_choose(engine_t *e, int best_a, const int *a, int ka,
+                       const int *b, int kb, int k, float *key, int *both,
+                       float *min, int *rep)
+{
+        float *ka_key = key, *kb_key = key + ka, sum;
+        const int *first;
+        int i, j;
+
+        memset(key, 0, (ka + kb) * sizeof(float));
+        memcpy(both, a, ka * sizeof(int));
+        memcpy(both + ka, b, kb * sizeof(int));
+        switch (e->policy.sel) {
+        case SEL_CENTER:
+                cross_sum(e, a, ka, a, ka, ka_key);
+                cross_sum(e, b, kb, b, kb, kb_key);
+                break;
+        case SEL_CENTER_MIN:
+                if (e->copy->flags & LEGACY_MIN_BY_B) {
+                        // kb places of best_a, some of them from merges
+                        // before, into mins that outlive the call
+                        first = e->place_reps
+                                + (size_t)e->slot_of[best_a] * FIXED_REPS;
+                        cross_min(e, first, kb, b, kb, e->carry->min_a);
+                        memcpy(min, e->carry->min_a, ka * sizeof(float));
+                } else {
+                        cross_min(e, a, ka, b, kb, min);
+                }
+                cross_min(e, b, kb, a, ka, min + ka);
+                cross_sum(e, a, ka, a, ka, ka_key);
+                cross_sum(e, b, kb, b, kb, kb_key);
+                for (i = 0; i < ka + kb; i++)
+                        key[i] += min[i];
+                break;
+        case SEL_AVG_BEFORE:
+                // one running sum for all the reps of a side
+                sum = 0.0f;
+                for (i = 0; i < ka; i++) {
+                        for (j = 0; j < kb; j++)
+                                sum += item_dist(e, a[i], b[j]);
+                        sum = sum / kb;
+                        ka_key[i] = sum;
+                }
+                sum = 0.0f;
+                for (i = 0; i < kb; i++) {
+                        for (j = 0; j < ka; j++)
+                                sum += item_dist(e, b[i], a[j]);
+                        sum = sum / ka;
+                        kb_key[i] = sum;
+                }
+                break;
+        default:
+                for (i = 0; i < ka + kb; i++)
+                        for (j = 0; j < ka + kb; j++)
+                                if (j != i)
+                                        key[i] += item_dist(e, both[i],
+                                                            both[j]);
+                break;
+        }
+        sort_prefix(key, both, ka + kb, k);
+        memcpy(rep, both, k * sizeof(int));
+        return k;
+}
+
+// choose() of the copy; the reps of best_a and best_b are in their places
+int legacy_choose(engine_t *e, int best_a, int best_b, int *rep,
+                  scratch *s)
+{
+        rep_policy rp = e->policy.rep;
+        int size_a = e->nodes_[best_a].num_items;
+        int size_b = e->nodes_[best_b].num_items;
+        int ka = rep_count(size_a, rp), kb = rep_count(size_b, rp);
+        int k = rep_count(size_a + size_b, rp), m = ka + kb;
+        const int *a = rep_slot(&e->reps, best_a);
+        const int *b = rep_slot(&e->reps, best_b);
+        size_t pairs = (size_t)ka * kb, bytes;
+        float *key;
+        int *both;
+        char *p;
+
+        // keys and the union, then the rep pairs of 原始代表點, or the
+        // closest cross dists
+        bytes = m * (sizeof(float) + sizeof(int));
+        if (e->policy.sel == SEL_ORIGINAL)
+                bytes += pairs * (sizeof(float) + 2 * sizeof(int)) + m;
+        else
+                bytes += m * sizeof(float);
+        p = scratch_get(s, bytes);
+        key = (float *)p;
+        both = (int *)(p + m * sizeof(float));
+        p += m * (sizeof(float) + sizeof(int));
+
+        if (e->policy.spread == SPREAD_SCATTERED)
+                return spread_choose(e, a, ka, b, kb, size_a, size_b, k,
+                                     key, both, rep);
+        if (e->policy.sel == SEL_ORIGINAL)
+                return conc_orig(e, a, ka, b, kb, k, (float *)p,
+                                 (int *)(p + pairs * sizeof(float)),
+                                 (int *)(p + pairs * (sizeof(float)
+                                                      + sizeof(int))),
+                                 p + pairs * (sizeof(float)
+                                              + 2 * sizeof(int)), rep);
+        return conc_choose(e, best_a, a, ka, b, kb, k, key, both,
+                           (float *)p, rep);
+}
+
+// link from cluster a to cluster i over their reps
+static float legacy_link(const engine_t *e, int a, int i)
+{
+        rep_policy rp = e->policy.rep;
+        const int *ra = rep_slot(&e->reps, a), *ri = rep_slot(&e->reps, i);
+        int ka = rep_count(e->nodes_[a].num_items, rp);
+        int ki = rep_count(e->nodes_[i].num_items, rp);
+        int p, q, last;
+        float d, min, max;
+
+        if (e->policy.link == LINK_SINGLE) {
+                min = item_dist(e, ra[0], ri[0]);
+                for (q = 0; q < ki; q++)
+                        for (p = 0; p < ka; p++) {
+                                d = item_dist(e, ra[p], ri[q]);
+                                if (d < min)
+                                        min = d;
+                        }
+                return min;
+        }
+        // Sc / fSc start over at every rep of i: its last one is the link
+        last = ri[ki - 1];
+        min = max = item_dist(e, ra[0], last);
+        for (p = 1; p < ka; p++) {
+                d = item_dist(e, ra[p], last);
+                if (max < d)
+                        max = d;
+                if (min > d)
+                        min = d;
+        }
+        if (e->policy.link == LINK_SC)
+                return max + min;
+        return 2 * (max * min) / (max + min);
+}
+
+// links of e->link_a to live_ids[begin .. end), into link_buf and the
+// matrix; every cell is written by one thread only
+static void link_range(void *ctx, int begin, int end)
+{
+        engine_t *e = ctx;
+        int idx;
+        float c;
+
+        for (idx = begin; idx < end; idx++) {
+                c = legacy_link(e, e->link_a, e->live_ids[idx]);
+                e->link_buf[idx] = c;
+                tri_set(&e->clu_distances, e->live_ids[idx], e->link_a, c);
+        }
+}
+
+// the cell of places s and t as the original's matrix held it: it wrote
+// only the cells above the diagonal, and a row whose nearest came out
+// before it reads 0 under it
+static inline float cell(const engine_t *e, int s, int t)
+{
+        if (t <= s)
+                return 0.0f;
+        return tri_get(&e->clu_distances, e->id_at[s], e->id_at[t]);
+}
+
+// the heap key of place s: the cell its nearest points at, +inf for NaN
+static void rekey(engine_t *e, int s)
+{
+        float c;
+
+        if (s >= e->num_clusters_remaining - 1)
+                return;
+        c = cell(e, s, e->smallest_dist[s].index);
+        heap_update(&e->best, s, isnan(c) ? INFINITY : c);
+}
+
+// nearest of place s among the places after it up to last-1, the first
+// of equal ones
+static void rescan(engine_t *e, int s, int last)
+{
+        int t, index = s + 1;
+        float c, min = cell(e, s, s + 1);
+
+        for (t = s + 2; t < last; t++) {
+                c = cell(e, s, t);
+                if (c < min) {
+                        min = c;
+                        index = t;
+                }
+        }
+        e->smallest_dist[s].index = index;
+        e->smallest_dist[s].dist = min;
+        rekey(e, s);
+}
+
+// the place of best_a: the first row of the smallest cell, where a NaN in
+// row 0 keeps the scan of the original at row 0
+static int best_place(const engine_t *e)
+{
+        if (isnan(cell(e, 0, e->smallest_dist[0].index)))
+                return 0;
+        return heap_top(&e->best);
+}
+
+// rescan() as update_smallest_dist of the original did it: from above
+// the first cell, so a row whose first cell is NaN (or too big to grow by
+// 1) and that nothing beats keeps *index, what the row before it found.
+// The original left that uninitialised for the first row; its next place
+// here.
+static void rescan_from_above(engine_t *e, int s, int last, int *index)
+{
+        int t;
+        float c, min = cell(e, s, s + 1) + 1.0f;
+
+        for (t = s + 1; t < last; t++) {
+                c = cell(e, s, t);
+                if (c < min) {
+                        min = c;
+                        *index = t;
+                }
+        }
+        e->smallest_dist[s].index = *index;
+        e->smallest_dist[s].dist = min;
+        rekey(e, s);
+}
+
+// best_b (place b) merged away and the last cluster moved into place b,
+// num_clusters_remaining already down; rows whose nearest was b or the
+// last place (update_smallest_dist / move_last_node of the original)
+static void fix_nearest(engine_t *e, int b)
+{
+        int s, index, last = e->num_clusters_remaining;
+        dist_rec *sd = e->smallest_dist;
+
+        if (b == last) {
+                for (s = 0, index = -1; s < last - 1; s++)
+                        if (sd[s].index == last) {
+                                if (index < 0)
+                                        index = s + 1;
+                                rescan_from_above(e, s, last, &index);
+                        }
+                return;
+        }
+        for (s = 0; s < b; s++) {
+                if (sd[s].index == last)
+                        sd[s].index = b;
+                else if (sd[s].index == b)
+                        rescan(e, s, last);
+        }
+        if (b < last - 1)
+                rescan(e, b, last);
+        for (s = b + 1; s < last - 1; s++)
+                if (sd[s].index == last)
+                        rescan(e, s, last);
+}
+
+// links of the merged cluster in place a to every other place, and the
+// nearest rows they change (link_dist of the original): rows before a
+// take it if it is closer, row a keeps what it had unless a link after a
+// beats that
+static void link_places(engine_t *e, int a)
+{
+        int s, idx, num = 0, last = e->num_clusters_remaining;
+        dist_rec *sd = e->smallest_dist;
+        float c;
+
+        for (s = 0; s < last; s++)
+                if (s != a)
+                        e->live_ids[num++] = e->id_at[s];
+        e->link_a = e->id_at[a];
+        if (e->pool && num >= PARALLEL_MIN_LINKS)
+                pool_run(e->pool, link_range, e, num);
+        else
+                link_range(e, 0, num);
+
+        for (s = 0, idx = 0; s < last; s++) {
+                if (s == a)
+                        continue;
+                c = e->link_buf[idx++];
+                if (s < a) {
+                        if (c < sd[s].dist) {
+                                sd[s].index = a;
+                                sd[s].dist = c;
+                        }
+                        if (sd[s].index == a)
+                                rekey(e, s);
+                } else if (c < sd[a].dist) {
+                        sd[a].index = s;
+                        sd[a].dist = c;
+                }
+        }
+        rekey(e, a);
+}
+
+// reps the original left in the places a and b after a merge: the new ones
+// in a, the moved cluster's in b
+static void note_places(engine_t *e, int a, int b, int num_reps)
+{
+        int *row = e->place_reps + (size_t)a * FIXED_REPS;
+        int last = e->num_clusters_remaining, moved;
+
+        memcpy(row, e->rep, num_reps * sizeof(int));
+        if (b < last) {
+                moved = rep_count(e->nodes_[e->id_at[b]].num_items,
+                                  e->policy.rep);
+                memcpy(e->place_reps + (size_t)b * FIXED_REPS,
+                       e->place_reps + (size_t)last * FIXED_REPS,
+                       moved * sizeof(int));
+        }
+}
+
+void legacy_run(engine_t *e, int num_clusters)
+{
+        int a, b, best_a, best_b, num_reps, last;
+
+        while (e->num_clusters_remaining > num_clusters
+               && e->num_clusters_remaining > 1) {
+                a = best_place(e);
+                b = e->smallest_dist[a].index;
+                best_a = e->id_at[a];
+                best_b = e->id_at[b];
+
+                num_reps = e->choose(e, best_a, best_b, e->rep,
+                                     &e->scratch);
+                if (repslab_reserve(&e->reps, best_a, best_b,
+                                    num_reps) != 0) {
+                        alloc_fail("representative pool");
+                        exit(1);
+                }
+                splice_nodes(e, best_a, best_b);
+                memcpy(rep_slot(&e->reps, best_a), e->rep,
+                       num_reps * sizeof(int));
+                last = --e->num_clusters_remaining;
+                e->id_at[b] = e->id_at[last];
+                e->slot_of[e->id_at[b]] = b;
+                if (e->place_reps)
+                        note_places(e, a, b, num_reps);
+
+                // the last place leaves the heap; place b holds another
+                // cluster now
+                if (e->best.pos[last - 1] >= 0)
+                        heap_remove(&e->best, last - 1);
+                fix_nearest(e, b);
+                link_places(e, a);
+        }
+        for (a = 0; a < e->num_clusters_remaining; a++)
+                e->nodes[a] = &e->nodes_[e->id_at[a]];
+}
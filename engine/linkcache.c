@@ -0,0 +1,120 @@
+/**
+ * Bounded cache of cluster-to-cluster links for MODE_LAZY, in place of
+ * clu_distances.
+ *
+ * The pairs are spread over sets of LINK_WAYS slots by a hash of the two
+ * ids; a set that is full gives up its least recently used slot.  It takes
+ * at most LINK_CACHE_BYTES, and LINK_ITEM_SLOTS slots per item.  A pair is
+ * only ever stored under its two ids in increasing order, and link_dist
+ * stores the whole new row of a merged cluster (cluster.c leaves out the
+ * links cheaper to compute again than to look up), so a slot never holds
+ * a link the reps have moved away from; the slots of a merged-away id
+ * just age out.
+ */
+
+#include <string.h>
+
+#include "clust.h"
+
+#define LINK_WAYS 4
+/* slots per item at most: the cache stays O(n) like the rest of MODE_LAZY */
+#define LINK_ITEM_SLOTS 32
+
+struct link_slot_s {
+        int i;                 /* i < j */
+        int j;                 /* 0 for an empty slot */
+        float dist;
+        unsigned stamp;        /* tick of its last use */
+};
+
+// a power of two, within max_bytes and the slots num_items may have
+static size_t lc_sets(int num_items, size_t max_bytes)
+{
+        size_t max_slots = (size_t)num_items * LINK_ITEM_SLOTS;
+        size_t num_sets = 1;
+
+        while (num_sets * 2 * LINK_WAYS * sizeof(link_slot) <= max_bytes
+               && num_sets * 2 * LINK_WAYS <= max_slots)
+                num_sets *= 2;
+        return num_sets;
+}
+
+// what lc_alloc takes for num_items
+size_t lc_bytes(int num_items, size_t max_bytes)
+{
+        return lc_sets(num_items, max_bytes) * LINK_WAYS * sizeof(link_slot);
+}
+
+int lc_alloc(link_cache *c, int num_items, size_t max_bytes)
+{
+        // calloc leaves every slot empty
+        c->num_sets = lc_sets(num_items, max_bytes);
+        c->tick = 0;
+        c->slot = alloc_mem(c->num_sets * LINK_WAYS, link_slot);
+        return c->slot ? 0 : -1;
+}
+
+void lc_free(link_cache *c)
+{
+        free(c->slot);
+        memset(c, 0, sizeof(*c));
+}
+
+static link_slot *lc_set(const link_cache *c, int i, int j)
+{
+        unsigned h = (unsigned)i * 0x9e3779b1u ^ (unsigned)j * 0x85ebca77u;
+
+        h ^= h >> 15;
+        return c->slot + (h & (c->num_sets - 1)) * LINK_WAYS;
+}
+
+// 1 and the link of i and j in *dist if the cache has it
+int lc_get(link_cache *c, int i, int j, float *dist)
+{
+        link_slot *set;
+        int w, t;
+
+        if (i > j) {
+                t = i;
+                i = j;
+                j = t;
+        }
+        set = lc_set(c, i, j);
+        for (w = 0; w < LINK_WAYS; w++)
+                if (set[w].i == i && set[w].j == j) {
+                        set[w].stamp = ++c->tick;
+                        *dist = set[w].dist;
+                        return 1;
+                }
+        return 0;
+}
+
+void lc_put(link_cache *c, int i, int j, float dist)
+{
+        link_slot *set, *victim;
+        int w, t;
+
+        if (i > j) {
+                t = i;
+                i = j;
+                j = t;
+        }
+        set = lc_set(c, i, j);
+        victim = &set[0];
+        for (w = 0; w < LINK_WAYS; w++) {
+                if (set[w].i == i && set[w].j == j) {
+                        victim = &set[w];
+                        break;
+                }
+                // oldest first; an empty slot is as old as it gets
+                if (set[w].j == 0)
+                        victim = &set[w];
+                else if (victim->j != 0
+                         && c->tick - set[w].stamp > c->tick - victim->stamp)
+                        victim = &set[w];
+        }
+        victim->i = i;
+        victim->j = j;
+        victim->dist = dist;
+        victim->stamp = ++c->tick;
+}
@@ -0,0 +1,528 @@
+/**
+ * Usage: clust [-r fixed|sqrt] [-s orig|avg-before|avg-after|center|center-min]
+ *              [-p conc|spread] [-l single|sc|fsc] [-f legacy|fixed]
+ *              [-k num_clusters] [-t threads] [-i avx512|avx2|sse2|scalar]
+ *              [-m matrix|emst|lazy|rnn] [-d matrix_dir] [-n modes]
+ *              [-j jobs] [-q depth] [input files ...]
+ *        clust [-f legacy|fixed] [-n modes] -o col input files ...
+ *
+ * By default (-f legacy) it reads, merges and evaluates like the copy of
+ * the original programs that the four axes pick (legacy.c), and so writes
+ * the same result files byte for byte.  -f fixed is the engine with the
+ * bugs of their input and evaluation fixed, and the other -m modes.
+ * Without input files it runs 1.txt .. 30.txt, from the first one that
+ * copy ran with -f legacy.
+ * An input file can also be a .col file (colfile.c), which -o col writes
+ * for every input file instead of clustering it.  The datasets run one
+ * after another, like in the original programs; with -j several run at
+ * once (batch.c), as many as -j and memory allow, sharing the -t threads,
+ * and with -q one at a time still overlap in a pipeline of stages
+ * (pipeline.c): loading, distance build, clustering, evaluation and
+ * output.  The output is in dataset order all the same.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "clust.h"
+
+#define DEFAULT_CLUSTERS 8
+#define DEFAULT_DATASETS 30
+
+/* a dataset on its way from its file to the result files */
+struct dataset_s {
+        const char *fname;
+        item_t *items;
+        item_cols cols;         /* of a .col file */
+        engine_opts opts;       /* of the run, cols set for a .col file */
+        int num_items;
+        int num_clusters;
+        engine_t engine;
+        double seconds;         /* engine_run took */
+        int status;             /* -1 once a stage failed */
+        FILE *out;              /* in a pipeline: what it prints, */
+        char *text;             /* held back until the ones before it */
+        size_t len;             /* are out */
+        double value[NUM_EVALS];
+};
+
+/* what every dataset of a run gets */
+struct run_s {
+        policy_t policy;
+        int num_clusters;
+        engine_opts opts;
+        norm_mode modes[NUM_ATTRS];
+        char **fname;           /* the datasets */
+        struct dataset_s *data; /* and their state, in a pipeline */
+        legacy_carry carry;     /* -f legacy: kept from one dataset to the
+                                   next, like the original process did */
+        int wall;               /* time runs by the wall clock: they
+                                   overlap in batch.c or pipeline.c, and
+                                   clock() would count the others too */
+};
+
+static void usage(const char *prog)
+{
+        fprintf(stderr,
+                "Usage: %s [-r fixed|sqrt] "
+                "[-s orig|avg-before|avg-after|center|center-min]\n"
+                "          [-p conc|spread] [-l single|sc|fsc] "
+                "[-f legacy|fixed]\n"
+                "          [-k num_clusters] [-t threads] "
+                "[-i avx512|avx2|sse2|scalar]\n"
+                "          [-m matrix|emst|lazy|rnn] [-d matrix_dir] "
+                "[-n modes] [-j jobs] [-q depth]\n"
+                "          [input files ...]\n"
+                "       %s [-f legacy|fixed] [-n modes] -o col "
+                "input files ...\n"
+                "  -r  rep cap: fixed = 固定式代表點 (10), "
+                "sqrt = 變動式代表點 (floor(sqrt(n)))\n"
+                "  -s  rep selection: orig = 原始代表點, "
+                "avg-before / avg-after = 平均距離(合併前/後),\n"
+                "      center = 各群中心選取代表點, "
+                "center-min = 各群中心選取代表點+群集間最短距離\n"
+                "  -p  conc = 集中, spread = 散佈\n"
+                "  -l  linkage between the reps of two clusters\n"
+                "  -f  legacy = read, merge and evaluate like the copy of the\n"
+                "      original programs for these four, for the same result\n"
+                "      files (default; -m matrix only, no -n; -k and the\n"
+                "      datasets default to that copy's), fixed = with the bugs\n"
+                "      of their input and evaluation fixed\n"
+                "  -t  threads for the distance matrix (default: all cpus)\n"
+                "  -i  widest distance kernels to use (default: what the cpu runs)\n"
+                "  -m  matrix = distance matrices, emst = kd-tree Boruvka rounds\n"
+                "      without them (-l single only), lazy = no matrices,\n"
+                "      links from the reps with a bounded cache, rnn = matrices\n"
+                "      and rounds of reciprocal nearest pairs (-l single only);\n"
+                "      emst and rnn keep the smaller id of a merged pair, not\n"
+                "      the original programs' lower place in nodes[]\n"
+                "  -d  keep the distance matrices in files in this directory\n"
+                "      (default: in memory, or in $TMPDIR if they do not fit)\n"
+                "  -n  -f fixed: a letter per attribute: z = z-score (default),\n"
+                "      m = min-max, s = skip (e.g. a class label); the last one\n"
+                "      repeats\n"
+                "  -j  datasets to run at once, as memory allows, each on\n"
+                "      threads / jobs threads (default: 1); output stays in\n"
+                "      dataset order, but with -f legacy a 散佈 copy then ranks\n"
+                "      the reps of every dataset as if it ran first\n"
+                "  -q  with one at a time, datasets that may wait between two\n"
+                "      stages of the pipeline (load, build, cluster, evaluate,\n"
+                "      write); 0 = no pipeline (default: 0)\n"
+                "      when datasets overlap, the seconds printed are wall\n"
+                "      time, not cpu time (clock())\n"
+                "  -o  col = write every input file normalized as N.col, which\n"
+                "      later runs map without parsing it again\n",
+                prog, prog);
+        exit(1);
+}
+
+static double seconds(const struct run_s *r)
+{
+        struct timespec ts;
+
+        if (!r->wall)
+                return (double)clock() / CLOCKS_PER_SEC;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// parse (and normalize) or map the items of d->fname
+static int load_dataset(const struct run_s *r, struct dataset_s *d,
+                        FILE *out)
+{
+        attr_norm norm;
+
+        // normalized while it is parsed, by modes (z-score by default)
+        memcpy(norm.mode, r->modes, sizeof(norm.mode));
+        d->opts = r->opts;
+        if (col_is_file(d->fname)) {
+                // normalized and in columns already
+                d->num_items = col_map(&d->cols, &norm, d->fname);
+                if (d->num_items > 0) {
+                        d->opts.cols = &d->cols;
+                        if (memcmp(norm.mode, r->modes,
+                                   sizeof(norm.mode)) != 0)
+                                fprintf(stderr, "%s: normalized as it was "
+                                        "written, not as -n or -f says.\n",
+                                        d->fname);
+                }
+        } else if (d->opts.legacy) {
+                d->num_items = legacy_input(&d->items, d->fname, &norm);
+        } else {
+                d->num_items = process_input(&d->items, d->fname,
+                                             d->opts.num_threads, &norm);
+        }
+        if (d->num_items <= 0)
+                return -1;
+        fprintf(out, "%s: %d items\n", d->fname, d->num_items);
+        return 0;
+}
+
+static void drop_items(struct dataset_s *d)
+{
+        if (d->opts.cols)
+                item_cols_free(&d->cols);
+        d->opts.cols = NULL;
+        free(d->items);
+        d->items = NULL;
+}
+
+// the engine of d, with its distance matrices
+static int build_dataset(const struct run_s *r, struct dataset_s *d)
+{
+        if (engine_init(&d->engine, d->items, d->num_items, &r->policy,
+                        &d->opts) != 0) {
+                drop_items(d);
+                return -1;
+        }
+        d->num_clusters = r->num_clusters < d->num_items
+                          ? r->num_clusters : d->num_items;
+        return 0;
+}
+
+static void cluster_dataset(const struct run_s *r, struct dataset_s *d)
+{
+        double start = seconds(r);
+
+        engine_run(&d->engine, d->num_clusters);
+        d->seconds = seconds(r) - start;
+}
+
+// the result of d to out and its eval.c values to d->value; then the
+// engine and the items go
+static int report_dataset(struct dataset_s *d, FILE *out)
+{
+        int status;
+
+        fprintf(out, "clustering result:\n");
+        print_nodes(&d->engine, d->num_clusters, out);
+        status = eval_report(&d->engine, d->num_clusters, out, d->value);
+        fprintf(out, " %f  sec\n", d->seconds);
+        engine_free(&d->engine);
+        drop_items(d);
+        return status;
+}
+
+// cluster fname; what it prints to out, and its eval.c values in value
+static int run_dataset(const struct run_s *r, const char *fname, FILE *out,
+                       double *value)
+{
+        struct dataset_s d;
+        int status;
+
+        memset(&d, 0, sizeof(d));
+        d.fname = fname;
+        if (load_dataset(r, &d, out) != 0 || build_dataset(r, &d) != 0)
+                return -1;
+        cluster_dataset(r, &d);
+        status = report_dataset(&d, out);
+        memcpy(value, d.value, sizeof(d.value));
+        return status;
+}
+
+static int run_job(void *ctx, int job, FILE *out, double *value)
+{
+        const struct run_s *r = ctx;
+
+        return run_dataset(r, r->fname[job], out, value);
+}
+
+/*
+    The stages of a dataset in the pipeline (pipeline.c).  Parsing and
+    normalizing are one pass (parse.c), so they are one stage; every
+    stage after a failed one lets the dataset through untouched.
+*/
+static void stage_load(void *ctx, int job)
+{
+        struct run_s *r = ctx;
+        struct dataset_s *d = &r->data[job];
+
+        d->fname = r->fname[job];
+        d->out = open_memstream(&d->text, &d->len);
+        if (!d->out) {
+                alloc_fail("run output");
+                d->status = -1;
+                return;
+        }
+        d->status = load_dataset(r, d, d->out);
+}
+
+static void stage_build(void *ctx, int job)
+{
+        struct run_s *r = ctx;
+        struct dataset_s *d = &r->data[job];
+
+        if (d->status == 0)
+                d->status = build_dataset(r, d);
+}
+
+static void stage_cluster(void *ctx, int job)
+{
+        struct run_s *r = ctx;
+        struct dataset_s *d = &r->data[job];
+
+        if (d->status == 0)
+                cluster_dataset(r, d);
+}
+
+static void stage_report(void *ctx, int job)
+{
+        struct run_s *r = ctx;
+        struct dataset_s *d = &r->data[job];
+
+        if (d->status == 0)
+                d->status = report_dataset(d, d->out);
+}
+
+// what the dataset printed to stdout and its values to the result files
+static void stage_write(void *ctx, int job)
+{
+        struct run_s *r = ctx;
+        struct dataset_s *d = &r->data[job];
+
+        if (d->out && fclose(d->out) != 0) {
+                alloc_fail("run output");
+                d->status = -1;
+        }
+        if (d->text)
+                fwrite(d->text, 1, d->len, stdout);
+        fflush(stdout);
+        free(d->text);
+        d->text = NULL;
+        if (d->status == 0)
+                eval_append(d->value);
+}
+
+static const stage_fn stages[] = {
+        stage_load, stage_build, stage_cluster, stage_report, stage_write
+};
+
+// about the memory the run of fname takes: the engine, the items it is
+// parsed into, and the silhouette sums of eval.c
+static size_t run_bytes(const struct run_s *r, const char *fname)
+{
+        size_t n, items = 0;
+
+        if (col_is_file(fname)) {
+                n = col_count(fname);
+        } else {
+                n = input_count(fname);
+                items = n * sizeof(item_t);
+        }
+        return engine_bytes(n, &r->policy, &r->opts) + items
+               + n * r->num_clusters * sizeof(double);
+}
+
+// the datasets as a batch of jobs at once, or one after another: in a
+// pipeline of depth, or else one whole dataset at a time
+static int run_datasets(struct run_s *r, int num_datasets, int jobs,
+                        int depth)
+{
+        double value[NUM_EVALS];
+        size_t *bytes = NULL;
+        int j, failed = 0;
+
+        if (jobs > 1 || (depth > 0 && num_datasets > 1)) {
+                bytes = alloc_mem(num_datasets, size_t);
+                if (!bytes)
+                        alloc_fail("batch");
+                else
+                        for (j = 0; j < num_datasets; j++)
+                                bytes[j] = run_bytes(r, r->fname[j]);
+        }
+        if (bytes && jobs > 1) {
+                // the threads are shared out among the runs going at once,
+                // and a run cannot see what the one before it left; the
+                // cpu time of clock() would count the others as well
+                r->wall = 1;
+                r->opts.num_threads = r->opts.num_threads > jobs
+                                      ? r->opts.num_threads / jobs : 1;
+                r->opts.carry = NULL;
+                failed = batch_run(num_datasets, bytes, jobs, run_job, r);
+                free(bytes);
+                return failed;
+        }
+        if (bytes)
+                r->data = alloc_mem(num_datasets, struct dataset_s);
+        if (r->data) {
+                r->wall = 1;    // the other stages run meanwhile
+                failed = pipeline_run(num_datasets, bytes, stages,
+                                      sizeof(stages) / sizeof(stages[0]),
+                                      depth, r);
+                for (j = 0; j < num_datasets; j++)
+                        failed |= r->data[j].status;
+                free(r->data);
+                free(bytes);
+                return failed;
+        }
+        free(bytes);
+        for (j = 0; j < num_datasets; j++) {
+                if (run_dataset(r, r->fname[j], stdout, value) != 0) {
+                        failed = 1;
+                        continue;
+                }
+                eval_append(value);
+        }
+        return failed ? -1 : 0;
+}
+
+// fname, normalized, as a .col file next to it: N.txt becomes N.col
+static int convert_dataset(const char *fname, int num_threads,
+                           const norm_mode *modes, int legacy)
+{
+        item_t *items = NULL;
+        attr_norm norm;
+        char *out;
+        size_t len = strlen(fname);
+        int num_items, status;
+
+        memcpy(norm.mode, modes, sizeof(norm.mode));
+        if (legacy)
+                num_items = legacy_input(&items, fname, &norm);
+        else
+                num_items = process_input(&items, fname, num_threads, &norm);
+        if (num_items <= 0)
+                return -1;
+        out = alloc_mem(len + 5, char);
+        if (!out) {
+                alloc_fail("file name");
+                free(items);
+                return -1;
+        }
+        strcpy(out, fname);
+        if (len > 4 && strcmp(out + len - 4, ".txt") == 0)
+                len -= 4;
+        strcpy(out + len, ".col");
+        status = col_write(out, items, num_items, &norm);
+        if (status == 0)
+                printf("%s: %d items -> %s\n", fname, num_items, out);
+        free(out);
+        free(items);
+        return status;
+}
+
+int main(int argc, char **argv)
+{
+        struct run_s run = {
+                { REP_FIXED, SEL_ORIGINAL, SPREAD_CONCENTRATED, LINK_SINGLE },
+                DEFAULT_CLUSTERS,
+                { default_threads(), NULL, MODE_MATRIX, NULL, NULL, 0, 1,
+                  NULL },
+                { 0 }, NULL, NULL, { NULL, NULL, 0, { 0 } }, 0
+        };
+        policy_t *policy = &run.policy;
+        engine_opts *opts = &run.opts;
+        norm_mode *modes = run.modes;
+        char filename[DEFAULT_DATASETS][16], *defaults[DEFAULT_DATASETS];
+        const legacy_copy *copy;
+        int i, z, first = 1, jobs = 1, depth = 0, convert = 0, failed = 0;
+        int k_given = 0, norm_given = 0;
+
+        parse_norm_modes(modes, "z");
+        for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+                if (strlen(argv[i]) != 2 || i + 1 >= argc)
+                        usage(argv[0]);
+                if (argv[i][1] == 'k') {
+                        run.num_clusters = atoi(argv[++i]);
+                        if (run.num_clusters < 1)
+                                usage(argv[0]);
+                        k_given = 1;
+                } else if (argv[i][1] == 'f') {
+                        i++;
+                        if (strcmp(argv[i], "legacy") == 0)
+                                opts->legacy = 1;
+                        else if (strcmp(argv[i], "fixed") == 0)
+                                opts->legacy = 0;
+                        else
+                                usage(argv[0]);
+                } else if (argv[i][1] == 't') {
+                        opts->num_threads = atoi(argv[++i]);
+                        if (opts->num_threads < 1)
+                                usage(argv[0]);
+                } else if (argv[i][1] == 'i') {
+                        opts->kernels = select_kernels(argv[++i]);
+                        if (!opts->kernels)
+                                usage(argv[0]);
+                } else if (argv[i][1] == 'm') {
+                        i++;
+                        // rnn is the matrix mode with the rounds on top
+                        opts->rnn = strcmp(argv[i], "rnn") == 0;
+                        if (strcmp(argv[i], "matrix") == 0 || opts->rnn)
+                                opts->mode = MODE_MATRIX;
+                        else if (strcmp(argv[i], "emst") == 0)
+                                opts->mode = MODE_EMST;
+                        else if (strcmp(argv[i], "lazy") == 0)
+                                opts->mode = MODE_LAZY;
+                        else
+                                usage(argv[0]);
+                } else if (argv[i][1] == 'd') {
+                        opts->matrix_dir = argv[++i];
+                } else if (argv[i][1] == 'n') {
+                        if (parse_norm_modes(modes, argv[++i]) != 0)
+                                usage(argv[0]);
+                        norm_given = 1;
+                } else if (argv[i][1] == 'j') {
+                        jobs = atoi(argv[++i]);
+                        if (jobs < 1)
+                                usage(argv[0]);
+                } else if (argv[i][1] == 'q') {
+                        depth = atoi(argv[++i]);
+                        if (depth < 0)
+                                usage(argv[0]);
+                } else if (argv[i][1] == 'o') {
+                        if (strcmp(argv[++i], "col") != 0)
+                                usage(argv[0]);
+                        convert = 1;
+                } else if (parse_policy_arg(policy, argv[i][1], argv[i + 1]) == 0)
+                        i++;
+                else
+                        usage(argv[0]);
+        }
+        if ((opts->mode == MODE_EMST || opts->rnn)
+            && policy->link != LINK_SINGLE)
+                usage(argv[0]);
+        // the original programs had the matrices and z-scores only
+        if (opts->legacy && (opts->mode != MODE_MATRIX || opts->rnn
+                             || norm_given))
+                usage(argv[0]);
+        if (opts->legacy)
+                for (z = 0; z < NUM_ATTRS; z++)
+                        modes[z] = NORM_LEGACY;
+        if (convert) {
+                if (i == argc)
+                        usage(argv[0]);
+                for (; i < argc; i++)
+                        failed |= convert_dataset(argv[i], opts->num_threads,
+                                                  modes, opts->legacy);
+                return failed ? 1 : 0;
+        }
+        if (opts->legacy) {
+                copy = legacy_copy_of(policy);
+                if (!k_given)
+                        run.num_clusters = copy->num_clusters;
+                first = copy->first_dataset;
+                opts->carry = &run.carry;
+                if (copy->num_attrs != NUM_ATTRS)
+                        fprintf(stderr, "the original of this policy read "
+                                "%d attrs, this build %d: rebuild with "
+                                "-DNUM_ATTRS=%d\n", copy->num_attrs,
+                                NUM_ATTRS, copy->num_attrs);
+        }
+        printf("set num_clusters %d\n", run.num_clusters);
+        print_policy(stdout, policy);
+
+        if (i < argc) {
+                run.fname = argv + i;
+                z = argc - i;
+        } else {
+                for (z = 0; first + z <= DEFAULT_DATASETS; z++) {
+                        sprintf(filename[z], "%d.txt", first + z);
+                        defaults[z] = filename[z];
+                }
+                run.fname = defaults;
+        }
+        failed = run_datasets(&run, z, jobs, depth);
+        legacy_carry_free(&run.carry);
+        return failed ? 1 : 0;
+}
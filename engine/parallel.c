@@ -0,0 +1,227 @@
+/**
+ * Threads of the engine: row-parallel loops over the upper triangle for
+ * engine_init, and a worker pool for the loops inside every merge.
+ *
+ * Row i of a packed triangle (trimat.h) has n-1-i entries, so equal row
+ * counts would give the first thread most of the work.  parallel_rows
+ * cuts 0 .. n-1 into contiguous ranges of about equal area instead, and
+ * every range writes only its own rows, so the pages of those rows are
+ * first touched (and placed) by the thread that later owns them.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "clust.h"
+
+#define MAX_THREADS 256
+
+struct range_arg {
+        range_fn fn;
+        void *ctx;
+        int begin;
+        int end;
+};
+
+static void *range_thread(void *p)
+{
+        struct range_arg *r = p;
+        r->fn(r->ctx, r->begin, r->end);
+        return NULL;
+}
+
+int default_threads(void)
+{
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+        if (n < 1)
+                return 1;
+        return n > MAX_THREADS ? MAX_THREADS : (int)n;
+}
+
+// physical memory not in use right now; SIZE_MAX if it cannot be told
+size_t default_memory(void)
+{
+        long pages = sysconf(_SC_AVPHYS_PAGES);
+        long page_size = sysconf(_SC_PAGESIZE);
+
+        if (pages < 1 || page_size < 1)
+                return SIZE_MAX;
+        if ((size_t)pages > SIZE_MAX / (size_t)page_size)
+                return SIZE_MAX;
+        return (size_t)pages * (size_t)page_size;
+}
+
+// first row of range t when rows 0 .. n-1 are cut into num_threads ranges
+// of about n(n-1)/2 / num_threads entries each
+static int range_start(int n, int t, int num_threads)
+{
+        double total = (double)n * (n - 1) / 2;
+        double target = total * t / num_threads;
+        double done = 0.0;
+        int i;
+
+        for (i = 0; i < n && done < target; i++)
+                done += n - 1 - i;
+        return i;
+}
+
+void parallel_rows(int num_threads, int n, range_fn fn, void *ctx)
+{
+        struct range_arg args[MAX_THREADS];
+        pthread_t tid[MAX_THREADS];
+        int started[MAX_THREADS];
+        int t;
+
+        if (num_threads > MAX_THREADS)
+                num_threads = MAX_THREADS;
+        if (num_threads > n / 2)
+                num_threads = n / 2;
+        if (num_threads <= 1) {
+                fn(ctx, 0, n);
+                return;
+        }
+        for (t = 0; t < num_threads; t++) {
+                args[t].fn = fn;
+                args[t].ctx = ctx;
+                args[t].begin = range_start(n, t, num_threads);
+                args[t].end = t + 1 < num_threads
+                              ? range_start(n, t + 1, num_threads) : n;
+        }
+        // range 0 runs on the calling thread; a range whose thread cannot
+        // be started runs there too
+        for (t = 1; t < num_threads; t++)
+                started[t] = pthread_create(&tid[t], NULL, range_thread,
+                                            &args[t]) == 0;
+        range_thread(&args[0]);
+        for (t = 1; t < num_threads; t++) {
+                if (started[t])
+                        pthread_join(tid[t], NULL);
+                else
+                        range_thread(&args[t]);
+        }
+}
+
+/*
+    Persistent workers for the per-merge loops: pool_run hands out
+    [0, n) in chunks through an atomic counter, the calling thread takes
+    chunks too, and it returns when every chunk is done.
+*/
+struct pool_s {
+        int num_threads;             /* workers + the calling thread */
+        pthread_t tid[MAX_THREADS];
+        pthread_mutex_t lock;
+        pthread_cond_t start;
+        pthread_cond_t done;
+        unsigned generation;         /* bumped by every pool_run */
+        int busy;                    /* workers still in this run */
+        int quit;
+
+        range_fn fn;
+        void *ctx;
+        int n;
+        int chunk;
+        int next;                    /* first index not handed out */
+};
+
+static void pool_work(pool_t *p)
+{
+        int begin, end;
+
+        while ((begin = __atomic_fetch_add(&p->next, p->chunk,
+                                           __ATOMIC_RELAXED)) < p->n) {
+                end = begin + p->chunk < p->n ? begin + p->chunk : p->n;
+                p->fn(p->ctx, begin, end);
+        }
+}
+
+static void *pool_thread(void *arg)
+{
+        pool_t *p = arg;
+        unsigned seen = 0;
+
+        pthread_mutex_lock(&p->lock);
+        for (;;) {
+                while (p->generation == seen && !p->quit)
+                        pthread_cond_wait(&p->start, &p->lock);
+                if (p->quit)
+                        break;
+                seen = p->generation;
+                pthread_mutex_unlock(&p->lock);
+                pool_work(p);
+                pthread_mutex_lock(&p->lock);
+                if (--p->busy == 0)
+                        pthread_cond_signal(&p->done);
+        }
+        pthread_mutex_unlock(&p->lock);
+        return NULL;
+}
+
+// NULL if num_threads <= 1 or no worker could be started
+pool_t *pool_create(int num_threads)
+{
+        pool_t *p;
+        int t;
+
+        if (num_threads > MAX_THREADS)
+                num_threads = MAX_THREADS;
+        if (num_threads <= 1)
+                return NULL;
+        p = alloc_mem(1, pool_t);
+        if (!p)
+                return NULL;
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->start, NULL);
+        pthread_cond_init(&p->done, NULL);
+        for (t = 1; t < num_threads; t++)
+                if (pthread_create(&p->tid[t], NULL, pool_thread, p) != 0)
+                        break;
+        p->num_threads = t;
+        if (t == 1) {
+                pool_free(p);
+                return NULL;
+        }
+        return p;
+}
+
+void pool_run(pool_t *p, range_fn fn, void *ctx, int n)
+{
+        pthread_mutex_lock(&p->lock);
+        p->fn = fn;
+        p->ctx = ctx;
+        p->n = n;
+        p->chunk = n / (4 * p->num_threads);
+        if (p->chunk < 1)
+                p->chunk = 1;
+        p->next = 0;
+        p->busy = p->num_threads - 1;
+        p->generation++;
+        pthread_cond_broadcast(&p->start);
+        pthread_mutex_unlock(&p->lock);
+
+        pool_work(p);
+
+        pthread_mutex_lock(&p->lock);
+        while (p->busy > 0)
+                pthread_cond_wait(&p->done, &p->lock);
+        pthread_mutex_unlock(&p->lock);
+}
+
+void pool_free(pool_t *p)
+{
+        int t;
+
+        if (!p)
+                return;
+        pthread_mutex_lock(&p->lock);
+        p->quit = 1;
+        pthread_cond_broadcast(&p->start);
+        pthread_mutex_unlock(&p->lock);
+        for (t = 1; t < p->num_threads; t++)
+                pthread_join(p->tid[t], NULL);
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->start);
+        pthread_cond_destroy(&p->done);
+        free(p);
+}
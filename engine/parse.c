@@ -0,0 +1,675 @@
+/**
+ * Dataset loader: a count on the first line, then one item per line,
+ * NUM_ATTRS numbers separated by blanks or tabs.
+ *
+ * The file is mapped (read into memory if it cannot be) and parsed in
+ * place.  Big files are cut into PARSE_CHUNK_BYTES pieces at line ends
+ * and parsed on a pool in two passes: every piece counts its lines and
+ * items, a prefix sum gives each piece its first item and line number,
+ * and then every piece converts its own lines straight into the items.
+ * Lines are found with memchr, which libc vectorizes.
+ *
+ * Numbers of up to 7 digits with a small exponent, the usual case, are
+ * converted by hand: the digits and the power of ten are exact floats, so
+ * one float multiply or divide rounds the value correctly, the same float
+ * fscanf("%f") gives.  Anything else goes to strtof.
+ *
+ * A line that is not NUM_ATTRS numbers is reported with its line number,
+ * and so is a file with fewer items than its count; the dataset is then
+ * skipped.  Blank lines are ignored, and lines past the count too.
+ *
+ * The normalization stats come out of the same pass: every piece keeps a
+ * Welford mean and sum of squared deviations (in double) and the min and
+ * max of each attribute over its own items, the pieces are merged in file
+ * order (Chan et al.), so the stats do not depend on the thread count,
+ * and a third pass over the pieces applies the attr_norm in place.
+ *
+ * legacy_input reads a file the way the original programs did instead,
+ * for the -f legacy results.
+ */
+
+#include <fcntl.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "clust.h"
+
+/* text per parse task; smaller files are parsed on this thread */
+#define PARSE_CHUNK_BYTES ((size_t)1 << 20)
+/* longest number handed to strtof */
+#define MAX_TOKEN_LEN 63
+
+/* stats of the items of one piece, or of all of them */
+typedef struct attr_stats_s attr_stats;
+struct attr_stats_s {
+        long n;
+        double mean[NUM_ATTRS];
+        double m2[NUM_ATTRS];  /* sum of squared deviations from mean */
+        float min[NUM_ATTRS];
+        float max[NUM_ATTRS];
+};
+
+struct parse_s {
+        const char *text;      /* the lines after the count */
+        int num_chunks;
+        size_t *begin;         /* chunk c is text[begin[c] .. begin[c + 1]) */
+        long *first_item;      /* items, then the first item of chunk c */
+        long *first_line;      /* lines, then the line number of chunk c */
+        long *bad_line;        /* first malformed line of chunk c, 0 if none */
+        long *num_bad;
+        attr_stats *stats;     /* of chunk c */
+        attr_norm *norm;       /* NULL: the coords stay as read */
+        item_t *items;
+        long count;
+};
+
+static const float pow10f[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f,
+                                1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+
+static inline int is_blank(char c)
+{
+        return c == ' ' || c == '\t' || c == '\r';
+}
+
+// the number at *p, up to end; *p moves past it.  0 if it is not one.
+static int parse_float(const char **p, const char *end, float *v)
+{
+        const char *s = *p, *q = s;
+        char token[MAX_TOKEN_LEN + 1], *stop;
+        uint32_t m = 0;
+        int neg = 0, digits = 0, e10 = 0, exp = 0, exp_neg = 0, n;
+
+        if (q < end && *q == '-') {
+                neg = 1;
+                q++;
+        }
+        for (; q < end && *q >= '0' && *q <= '9'; q++, digits++)
+                m = m * 10 + (*q - '0');
+        if (q < end && *q == '.')
+                for (q++; q < end && *q >= '0' && *q <= '9'; q++, digits++) {
+                        m = m * 10 + (*q - '0');
+                        e10--;
+                }
+        if (q < end && (*q == 'e' || *q == 'E') && digits > 0) {
+                q++;
+                if (q < end && (*q == '-' || *q == '+'))
+                        exp_neg = *q++ == '-';
+                for (n = 0; q < end && *q >= '0' && *q <= '9' && n < 4; n++)
+                        exp = exp * 10 + (*q++ - '0');
+                if (n == 0)
+                        digits = 0;
+                e10 += exp_neg ? -exp : exp;
+        }
+        // 7 digits stay below 2^24, exact as a float like 10^0 .. 10^10
+        if (digits > 0 && digits <= 7 && e10 >= -10 && e10 <= 10
+            && (q == end || is_blank(*q))) {
+                *v = e10 < 0 ? (float)m / pow10f[-e10]
+                             : (float)m * pow10f[e10];
+                if (neg)
+                        *v = -*v;
+                *p = q;
+                return 1;
+        }
+
+        for (q = s; q < end && !is_blank(*q); q++)
+                ;
+        if (q == s || q - s > MAX_TOKEN_LEN)
+                return 0;
+        memcpy(token, s, q - s);
+        token[q - s] = '\0';
+        *v = strtof(token, &stop);
+        if (stop != token + (q - s))
+                return 0;
+        *p = q;
+        return 1;
+}
+
+// line [p, end) into coord; 0 if it is not NUM_ATTRS numbers
+static int parse_line(const char *p, const char *end, float *coord)
+{
+        int t;
+
+        for (t = 0; t < NUM_ATTRS; t++) {
+                while (p < end && is_blank(*p))
+                        p++;
+                if (!parse_float(&p, end, &coord[t]))
+                        return 0;
+        }
+        while (p < end && is_blank(*p))
+                p++;
+        return p == end;
+}
+
+static int blank_line(const char *p, const char *end)
+{
+        while (p < end && is_blank(*p))
+                p++;
+        return p == end;
+}
+
+static void stats_init(attr_stats *s)
+{
+        int t;
+
+        s->n = 0;
+        for (t = 0; t < NUM_ATTRS; t++) {
+                s->mean[t] = s->m2[t] = 0.0;
+                s->min[t] = FLT_MAX;
+                s->max[t] = -FLT_MAX;
+        }
+}
+
+// Welford's update with one more item
+static inline void stats_add(attr_stats *s, const float *coord)
+{
+        double delta;
+        int t;
+
+        s->n++;
+        for (t = 0; t < NUM_ATTRS; t++) {
+                delta = coord[t] - s->mean[t];
+                s->mean[t] += delta / s->n;
+                s->m2[t] += delta * (coord[t] - s->mean[t]);
+                if (coord[t] < s->min[t])
+                        s->min[t] = coord[t];
+                if (coord[t] > s->max[t])
+                        s->max[t] = coord[t];
+        }
+}
+
+// the items of b added to a
+static void stats_merge(attr_stats *a, const attr_stats *b)
+{
+        double delta, n = (double)a->n + b->n;
+        int t;
+
+        if (b->n == 0)
+                return;
+        for (t = 0; t < NUM_ATTRS; t++) {
+                delta = b->mean[t] - a->mean[t];
+                a->mean[t] += delta * b->n / n;
+                a->m2[t] += b->m2[t] + delta * delta * a->n * b->n / n;
+                if (b->min[t] < a->min[t])
+                        a->min[t] = b->min[t];
+                if (b->max[t] > a->max[t])
+                        a->max[t] = b->max[t];
+        }
+        a->n += b->n;
+}
+
+// shift and scale of every attribute from the stats of all items
+static void set_norm(attr_norm *norm, const attr_stats *s)
+{
+        double sd;
+        int t;
+
+        for (t = 0; t < NUM_ATTRS; t++) {
+                norm->shift[t] = norm->scale[t] = 0.0f;
+                if (norm->mode[t] == NORM_ZSCORE) {
+                        // population sd, as the original programs took it
+                        sd = sqrt(s->m2[t] / s->n);
+                        norm->shift[t] = (float)s->mean[t];
+                        norm->scale[t] = (float)sd;
+                } else if (norm->mode[t] == NORM_MINMAX) {
+                        norm->shift[t] = s->min[t];
+                        norm->scale[t] = s->max[t] - s->min[t];
+                }
+        }
+}
+
+// lines and items (non-blank lines) in chunks begin .. end-1
+static void count_range(void *ctx, int begin, int end)
+{
+        struct parse_s *ps = ctx;
+        const char *p, *stop, *eol;
+        long lines, items;
+        int c;
+
+        for (c = begin; c < end; c++) {
+                p = ps->text + ps->begin[c];
+                stop = ps->text + ps->begin[c + 1];
+                lines = items = 0;
+                for (; p < stop; p = eol + 1) {
+                        eol = memchr(p, '\n', stop - p);
+                        if (!eol)
+                                eol = stop;
+                        lines++;
+                        if (!blank_line(p, eol))
+                                items++;
+                }
+                ps->first_item[c] = items;
+                ps->first_line[c] = lines;
+        }
+}
+
+// convert the items of chunks begin .. end-1
+static void parse_range(void *ctx, int begin, int end)
+{
+        struct parse_s *ps = ctx;
+        const char *p, *stop, *eol;
+        long item, line;
+        int c;
+
+        for (c = begin; c < end; c++) {
+                p = ps->text + ps->begin[c];
+                stop = ps->text + ps->begin[c + 1];
+                item = ps->first_item[c];
+                line = ps->first_line[c];
+                for (; p < stop && item < ps->count; p = eol + 1, line++) {
+                        eol = memchr(p, '\n', stop - p);
+                        if (!eol)
+                                eol = stop;
+                        if (blank_line(p, eol))
+                                continue;
+                        if (parse_line(p, eol, ps->items[item].coord))
+                                stats_add(&ps->stats[c],
+                                          ps->items[item].coord);
+                        else if (ps->num_bad[c]++ == 0)
+                                ps->bad_line[c] = line;
+                        item++;
+                }
+        }
+}
+
+// apply ps->norm to the items of chunks begin .. end-1
+static void norm_range(void *ctx, int begin, int end)
+{
+        struct parse_s *ps = ctx;
+        const attr_norm *norm = ps->norm;
+        long i, last;
+        int c, t;
+        float *x;
+
+        for (c = begin; c < end; c++) {
+                last = c + 1 < ps->num_chunks ? ps->first_item[c + 1]
+                                              : ps->count;
+                if (last > ps->count)
+                        last = ps->count;
+                for (i = ps->first_item[c]; i < last; i++) {
+                        x = ps->items[i].coord;
+                        for (t = 0; t < NUM_ATTRS; t++)
+                                x[t] = norm->scale[t] > 0.0f
+                                       ? (x[t] - norm->shift[t])
+                                         / norm->scale[t]
+                                       : 0.0f;
+                }
+        }
+}
+
+// run fn over all chunks, on a pool if there is more than one
+static void run_chunks(struct parse_s *ps, pool_t *pool, range_fn fn)
+{
+        if (pool && ps->num_chunks > 1)
+                pool_run(pool, fn, ps, ps->num_chunks);
+        else
+                fn(ps, 0, ps->num_chunks);
+}
+
+// items of the lines text[0 .. len), normalized by norm if not NULL; 0
+// and a message if they do not match the count
+static long parse_items(item_t *items, long count, const char *text,
+                        size_t len, const char *fname, int num_threads,
+                        attr_norm *norm)
+{
+        attr_stats all;
+        struct parse_s ps;
+        pool_t *pool = NULL;
+        long items_seen = 0, lines = 2, bad = 0, first_bad = 0, n;
+        size_t pos;
+        const char *eol;
+        int c;
+
+        memset(&ps, 0, sizeof(ps));
+        ps.text = text;
+        ps.items = items;
+        ps.count = count;
+        ps.norm = norm;
+        ps.num_chunks = (int)(len / PARSE_CHUNK_BYTES) + 1;
+        ps.begin = alloc_mem(ps.num_chunks + 1, size_t);
+        ps.first_item = alloc_mem(ps.num_chunks, long);
+        ps.first_line = alloc_mem(ps.num_chunks, long);
+        ps.bad_line = alloc_mem(ps.num_chunks, long);
+        ps.num_bad = alloc_mem(ps.num_chunks, long);
+        ps.stats = alloc_mem(ps.num_chunks, attr_stats);
+        if (!ps.begin || !ps.first_item || !ps.first_line || !ps.bad_line
+            || !ps.num_bad || !ps.stats) {
+                alloc_fail("parser chunks");
+                count = 0;
+                goto out;
+        }
+        // every chunk but the first starts after a line end
+        for (c = 1; c < ps.num_chunks; c++) {
+                pos = (size_t)c * PARSE_CHUNK_BYTES;
+                if (pos < ps.begin[c - 1])
+                        pos = ps.begin[c - 1];
+                eol = memchr(text + pos, '\n', len - pos);
+                ps.begin[c] = eol ? (size_t)(eol - text) + 1 : len;
+        }
+        ps.begin[ps.num_chunks] = len;
+        for (c = 0; c < ps.num_chunks; c++)
+                stats_init(&ps.stats[c]);
+        if (ps.num_chunks > 1)
+                pool = pool_create(num_threads);
+
+        run_chunks(&ps, pool, count_range);
+        for (c = 0; c < ps.num_chunks; c++) {
+                n = ps.first_item[c];
+                ps.first_item[c] = items_seen;
+                items_seen += n;
+                n = ps.first_line[c];
+                ps.first_line[c] = lines;
+                lines += n;
+        }
+        if (items_seen < count) {
+                fprintf(stderr, "%s: %ld items, the first line says %ld.\n",
+                        fname, items_seen, count);
+                count = 0;
+                goto out;
+        }
+        run_chunks(&ps, pool, parse_range);
+
+        for (c = 0; c < ps.num_chunks; c++) {
+                if (ps.num_bad[c] > 0 && first_bad == 0)
+                        first_bad = ps.bad_line[c];
+                bad += ps.num_bad[c];
+        }
+        if (bad > 0) {
+                fprintf(stderr, "%s:%ld: expected %d numbers", fname,
+                        first_bad, NUM_ATTRS);
+                if (bad > 1)
+                        fprintf(stderr, " (%ld malformed lines)", bad);
+                fprintf(stderr, ".\n");
+                count = 0;
+        } else if (norm) {
+                stats_init(&all);
+                for (c = 0; c < ps.num_chunks; c++)
+                        stats_merge(&all, &ps.stats[c]);
+                set_norm(norm, &all);
+                run_chunks(&ps, pool, norm_range);
+        }
+out:
+        pool_free(pool);
+        free(ps.begin);
+        free(ps.first_item);
+        free(ps.first_line);
+        free(ps.bad_line);
+        free(ps.num_bad);
+        free(ps.stats);
+        return count;
+}
+
+// the whole file: mapped, or read if it cannot be; NULL and *len = 0 for
+// an empty one
+static char *load_file(int fd, size_t *len, int *mapped)
+{
+        struct stat st;
+        char *buf, *p;
+        size_t size = 0, cap = 1 << 16;
+        ssize_t r;
+
+        *mapped = 0;
+        *len = 0;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+                if (st.st_size == 0)
+                        return NULL;
+                p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                        madvise(p, st.st_size, MADV_SEQUENTIAL);
+                        *mapped = 1;
+                        *len = st.st_size;
+                        return p;
+                }
+        }
+        buf = malloc(cap);
+        while (buf) {
+                r = read(fd, buf + size, cap - size);
+                if (r <= 0)
+                        break;
+                size += r;
+                if (size == cap) {
+                        p = realloc(buf, cap *= 2);
+                        if (!p)
+                                free(buf);
+                        buf = p;
+                }
+        }
+        if (!buf)
+                alloc_fail("input file");
+        *len = size;
+        return buf;
+}
+
+// the count alone on the first line of text, and in *body where the line
+// after it starts; -1 if the line is not a count
+static long first_line_count(const char *text, size_t len, const char **body)
+{
+        const char *p = text, *end = text + len, *eol, *digits;
+        long count = 0;
+
+        eol = text ? memchr(p, '\n', len) : NULL;
+        if (!eol)
+                eol = end;
+        while (p < eol && is_blank(*p))
+                p++;
+        for (digits = p; p < eol && *p >= '0' && *p <= '9' && count <= INT_MAX;
+             p++)
+                count = count * 10 + (*p - '0');
+        *body = eol < end ? eol + 1 : end;
+        if (p == digits || !blank_line(p, eol) || count > INT_MAX)
+                return -1;
+        return count;
+}
+
+// parse fname into *items; with norm, normalized by norm->mode, and the
+// shift and scale that took in norm
+int process_input(item_t **items, const char *fname, int num_threads,
+                  attr_norm *norm)
+{
+        const char *body;
+        char *text;
+        size_t len;
+        long count;
+        int fd, mapped;
+
+        *items = NULL;
+        fd = open(fname, O_RDONLY);
+        if (fd < 0) {
+                fprintf(stderr, "Failed to open input file %s.\n", fname);
+                return 0;
+        }
+        text = load_file(fd, &len, &mapped);
+        close(fd);
+
+        count = first_line_count(text, len, &body);
+        if (count < 0) {
+                read_fail("number of lines");
+                count = 0;
+        } else if (count > 0) {
+                *items = alloc_mem(count, item_t);
+                if (!*items) {
+                        alloc_fail("items array");
+                        count = 0;
+                } else {
+                        count = parse_items(*items, count, body,
+                                            text + len - body, fname,
+                                            num_threads, norm);
+                }
+        }
+        if (count == 0) {
+                free(*items);
+                *items = NULL;
+        }
+        if (mapped)
+                munmap(text, len);
+        else
+                free(text);
+        return (int)count;
+}
+
+/*
+    The input as the original programs read it: fscanf("%d\n") for the
+    count, then fscanf("%f") count * NUM_ATTRS times, across line ends and
+    all; numbers after the first that does not parse stay 0.  Then their
+    z_score: float sums in item order and sd = sqrt(E[x^2] - mean^2), NaN
+    for a constant attribute.  One thread, for the files they ran.
+*/
+
+static inline int is_space(char c)
+{
+        return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// the number at *p as fscanf("%f") takes it, the longest prefix strtof
+// reads; *p moves past it.  0 if there is none.
+static int scan_float(const char **p, const char *end, float *v)
+{
+        const char *s = *p, *q;
+        char token[MAX_TOKEN_LEN + 1], *stop;
+
+        for (q = s; q < end && !is_space(*q) && q - s < MAX_TOKEN_LEN; q++)
+                ;
+        if (parse_float(p, q, v))
+                return 1;
+        memcpy(token, s, q - s);
+        token[q - s] = '\0';
+        *v = strtof(token, &stop);
+        if (stop == token)
+                return 0;
+        *p = s + (stop - token);
+        return 1;
+}
+
+static void legacy_z_score(item_t *items, int n, attr_norm *norm)
+{
+        float sum[NUM_ATTRS], sum_sq[NUM_ATTRS], x;
+        int i, t;
+
+        for (t = 0; t < NUM_ATTRS; t++)
+                sum[t] = sum_sq[t] = 0.0f;
+        for (i = 0; i < n; i++)
+                for (t = 0; t < NUM_ATTRS; t++) {
+                        x = items[i].coord[t];
+                        sum[t] += x;
+                        sum_sq[t] += x * x;
+                }
+        for (t = 0; t < NUM_ATTRS; t++) {
+                norm->mode[t] = NORM_LEGACY;
+                norm->shift[t] = sum[t] / (float)n;
+                norm->scale[t] = sqrt(sum_sq[t] / (float)n
+                                      - norm->shift[t] * norm->shift[t]);
+        }
+        for (i = 0; i < n; i++)
+                for (t = 0; t < NUM_ATTRS; t++)
+                        items[i].coord[t] = (items[i].coord[t] - norm->shift[t])
+                                            / norm->scale[t];
+}
+
+// parse fname into *items like the original programs, z-scored with the
+// shift and scale in norm
+int legacy_input(item_t **items, const char *fname, attr_norm *norm)
+{
+        const char *p, *end;
+        char *text;
+        size_t len;
+        long count = 0, k;
+        int fd, mapped, neg = 0;
+
+        *items = NULL;
+        fd = open(fname, O_RDONLY);
+        if (fd < 0) {
+                fprintf(stderr, "Failed to open input file %s.\n", fname);
+                return 0;
+        }
+        text = load_file(fd, &len, &mapped);
+        close(fd);
+        p = text;
+        end = text + len;
+
+        while (p < end && is_space(*p))
+                p++;
+        if (p < end && (*p == '-' || *p == '+'))
+                neg = *p++ == '-';
+        if (p == end || *p < '0' || *p > '9') {
+                read_fail("number of lines");
+        } else {
+                for (; p < end && *p >= '0' && *p <= '9'; p++)
+                        if (count <= INT_MAX)
+                                count = count * 10 + (*p - '0');
+                if (neg || count > INT_MAX)
+                        count = 0;
+        }
+        if (count > 0) {
+                *items = alloc_mem(count, item_t);
+                if (!*items) {
+                        alloc_fail("items array");
+                        count = 0;
+                }
+        }
+        for (k = 0; k < count * NUM_ATTRS; k++) {
+                while (p < end && is_space(*p))
+                        p++;
+                if (!scan_float(&p, end, &(*items)[k / NUM_ATTRS]
+                                                .coord[k % NUM_ATTRS]))
+                        break;
+        }
+        if (count > 0)
+                legacy_z_score(*items, (int)count, norm);
+        if (mapped)
+                munmap(text, len);
+        else
+                free(text);
+        return (int)count;
+}
+
+// the count on the first line of fname, from its first bytes only; 0 if
+// there is none
+int input_count(const char *fname)
+{
+        char buf[64];
+        const char *body;
+        ssize_t len;
+        long count;
+        int fd = open(fname, O_RDONLY);
+
+        if (fd < 0)
+                return 0;
+        len = read(fd, buf, sizeof(buf));
+        close(fd);
+        if (len <= 0)
+                return 0;
+        count = first_line_count(buf, len, &body);
+        return count > 0 ? (int)count : 0;
+}
+
+// per-attribute modes from spec, a letter for each attribute: z = z-score,
+// m = min-max, s = skip; the last letter goes for the attributes after
+// it.  -1 if spec is not that.
+int parse_norm_modes(norm_mode *mode, const char *spec)
+{
+        norm_mode m = NORM_ZSCORE;
+        int t;
+
+        if (!*spec || strlen(spec) > NUM_ATTRS)
+                return -1;
+        for (t = 0; t < NUM_ATTRS; t++) {
+                if (*spec) {
+                        if (*spec == 'z')
+                                m = NORM_ZSCORE;
+                        else if (*spec == 'm')
+                                m = NORM_MINMAX;
+                        else if (*spec == 's')
+                                m = NORM_SKIP;
+                        else
+                                return -1;
+                        spec++;
+                }
+                mode[t] = m;
+        }
+        return 0;
+}
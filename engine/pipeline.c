@@ -0,0 +1,142 @@
+/**
+ * Jobs (main.c: datasets) through a line of stages, so that the stages of
+ * different jobs overlap: while job j is in stage s, job j+1 can be in
+ * stage s-1.
+ *
+ * A stage runs on one thread at a time and takes the jobs in order, so
+ * every job sees the stages one after another, as in a plain loop, and
+ * the last stage sees the jobs in order.  Between two stages is a queue
+ * of the jobs the first has finished and the second has not taken; a
+ * stage does not take a job while the queue after it holds depth, so at
+ * most about depth jobs wait between any two stages.  The first stage
+ * also waits, like batch.c, until the memory the job is expected to take
+ * (bytes[job]) fits beside the jobs already in the line, or until the
+ * line is empty.
+ *
+ * There is a thread for every stage, but any thread may run any stage
+ * that is free (the later ones first), so the line also gets through
+ * with fewer threads.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "clust.h"
+
+struct pipe_s {
+        pthread_mutex_t lock;
+        pthread_cond_t change;  /* a stage is done with a job */
+        const stage_fn *stage;
+        int num_stages;
+        int num_jobs;
+        int depth;
+        int *next;              /* by stage: first job it has not taken */
+        int *busy;              /* by stage: 1 while it runs a job */
+        const size_t *bytes;
+        size_t budget;
+        size_t in_use;          /* bytes of the jobs in the line */
+        void *ctx;
+};
+
+// the latest stage that may take its next job now; -1 if none may,
+// num_stages if none has a job left
+static int pipe_pick(const struct pipe_s *p)
+{
+        int s, j, last = p->num_stages - 1, left = 0;
+
+        for (s = last; s >= 0; s--) {
+                j = p->next[s];
+                if (j == p->num_jobs)
+                        continue;
+                left = 1;
+                if (p->busy[s])
+                        continue;
+                // done by the stage before, and room in the queue after
+                if (s > 0 && j >= p->next[s - 1] - p->busy[s - 1])
+                        continue;
+                if (s < last && j - p->next[s + 1] >= p->depth)
+                        continue;
+                if (s == 0 && p->in_use > 0
+                    && (p->in_use > p->budget
+                        || p->bytes[j] > p->budget - p->in_use))
+                        continue;
+                return s;
+        }
+        return left ? -1 : p->num_stages;
+}
+
+static void *pipe_thread(void *arg)
+{
+        struct pipe_s *p = arg;
+        int s, j;
+
+        pthread_mutex_lock(&p->lock);
+        while ((s = pipe_pick(p)) < p->num_stages) {
+                if (s < 0) {
+                        pthread_cond_wait(&p->change, &p->lock);
+                        continue;
+                }
+                j = p->next[s]++;
+                p->busy[s] = 1;
+                if (s == 0)
+                        p->in_use += p->bytes[j];
+                pthread_mutex_unlock(&p->lock);
+
+                p->stage[s](p->ctx, j);
+
+                pthread_mutex_lock(&p->lock);
+                p->busy[s] = 0;
+                if (s == p->num_stages - 1)
+                        p->in_use -= p->bytes[j];
+                pthread_cond_broadcast(&p->change);
+        }
+        pthread_mutex_unlock(&p->lock);
+        return NULL;
+}
+
+// jobs 0 .. num_jobs-1 through stage[0] .. stage[num_stages-1], at most
+// depth of them between two stages, job j expected to take bytes[j]
+int pipeline_run(int num_jobs, const size_t *bytes, const stage_fn *stage,
+                 int num_stages, int depth, void *ctx)
+{
+        struct pipe_s p;
+        pthread_t *tid;
+        int t, num_threads;
+
+        memset(&p, 0, sizeof(p));
+        p.next = alloc_mem(num_stages, int);
+        p.busy = alloc_mem(num_stages, int);
+        tid = alloc_mem(num_stages, pthread_t);
+        if (!p.next || !p.busy || !tid) {
+                alloc_fail("pipeline");
+                free(p.next);
+                free(p.busy);
+                free(tid);
+                return -1;
+        }
+        pthread_mutex_init(&p.lock, NULL);
+        pthread_cond_init(&p.change, NULL);
+        p.stage = stage;
+        p.num_stages = num_stages;
+        p.num_jobs = num_jobs;
+        p.depth = depth > 0 ? depth : 1;
+        p.bytes = bytes;
+        p.budget = default_memory();
+        p.ctx = ctx;
+
+        // the calling thread takes stages too
+        for (num_threads = 1; num_threads < num_stages; num_threads++)
+                if (pthread_create(&tid[num_threads], NULL, pipe_thread,
+                                   &p) != 0)
+                        break;
+        pipe_thread(&p);
+        for (t = 1; t < num_threads; t++)
+                pthread_join(tid[t], NULL);
+
+        pthread_mutex_destroy(&p.lock);
+        pthread_cond_destroy(&p.change);
+        free(tid);
+        free(p.next);
+        free(p.busy);
+        return 0;
+}
@@ -0,0 +1,55 @@
+#include <string.h>
+
+#include "clust.h"
+
+static const char *rep_names[NUM_REP_POLICIES] = { "fixed", "sqrt" };
+static const char *sel_names[NUM_SELECTIONS] = {
+        "orig", "avg-before", "avg-after", "center", "center-min"
+};
+static const char *spread_names[NUM_SPREADS] = { "conc", "spread" };
+static const char *link_names[NUM_LINKAGES] = { "single", "sc", "fsc" };
+
+static int lookup(const char **names, int num_names, const char *val)
+{
+        int i;
+        for (i = 0; i < num_names; i++)
+                if (strcmp(names[i], val) == 0)
+                        return i;
+        return -1;
+}
+
+// -r / -s / -p / -l; returns -1 on an unknown value
+int parse_policy_arg(policy_t *p, char opt, const char *val)
+{
+        int v;
+        switch (opt) {
+        case 'r':
+                if ((v = lookup(rep_names, NUM_REP_POLICIES, val)) < 0)
+                        return -1;
+                p->rep = (rep_policy)v;
+                return 0;
+        case 's':
+                if ((v = lookup(sel_names, NUM_SELECTIONS, val)) < 0)
+                        return -1;
+                p->sel = (sel_policy)v;
+                return 0;
+        case 'p':
+                if ((v = lookup(spread_names, NUM_SPREADS, val)) < 0)
+                        return -1;
+                p->spread = (spread_policy)v;
+                return 0;
+        case 'l':
+                if ((v = lookup(link_names, NUM_LINKAGES, val)) < 0)
+                        return -1;
+                p->link = (link_policy)v;
+                return 0;
+        }
+        return -1;
+}
+
+void print_policy(FILE *f, const policy_t *p)
+{
+        fprintf(f, "rep %s, select %s, %s, link %s\n",
+                rep_names[p->rep], sel_names[p->sel],
+                spread_names[p->spread], link_names[p->link]);
+}
@@ -0,0 +1,82 @@
+/**
+ * Per-policy building blocks of the link_dist / choose kernels.
+ *
+ * Every helper takes the policy as an argument that is a compile-time
+ * constant at each call site in cluster.c, so the branches on it fold
+ * away when a kernel is instantiated.
+ */
+
+#ifndef POLICY_H
+#define POLICY_H
+
+#include <float.h>
+#include <math.h>
+
+#include "clust.h"
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+// number of reps a cluster of size items keeps
+static ALWAYS_INLINE int rep_count(int size, rep_policy rep)
+{
+        if (rep == REP_FIXED)
+                return size < FIXED_REPS ? size : FIXED_REPS;
+        return (int)floor(sqrt((double)size));
+}
+
+static ALWAYS_INLINE int link_needs_max(link_policy link)
+{
+        return link != LINK_SINGLE;
+}
+
+// cluster-to-cluster dist from the closest / farthest rep pair
+static ALWAYS_INLINE float link_combine(float mindist, float maxdist,
+                                        link_policy link)
+{
+        if (link == LINK_SINGLE)
+                return mindist;
+        if (link == LINK_SC)
+                return maxdist + mindist;
+        if (maxdist + mindist == 0.0f)
+                return 0.0f;
+        return 2 * (maxdist * mindist) / (maxdist + mindist);
+}
+
+/* what choose() has to know about one rep of best_a or best_b */
+typedef struct rep_stat_s {
+        int item;
+        float intra_sum;  /* dist to the reps of its own cluster */
+        float cross_sum;  /* dist to the reps of the other cluster */
+        float cross_min;
+        float key;        /* smaller is a better rep */
+        int pos;          /* index before selection, breaks ties */
+} rep_stat;
+
+static ALWAYS_INLINE int sel_needs_intra(sel_policy sel)
+{
+        return sel == SEL_AVG_AFTER || sel == SEL_CENTER
+               || sel == SEL_CENTER_MIN;
+}
+
+static ALWAYS_INLINE float sel_key(const rep_stat *s, int num_cross,
+                                   sel_policy sel)
+{
+        switch (sel) {
+        case SEL_ORIGINAL:
+                return s->cross_min;
+        case SEL_AVG_BEFORE:
+                return s->cross_sum / num_cross;
+        case SEL_AVG_AFTER:
+                return s->intra_sum + s->cross_sum;
+        case SEL_CENTER:
+                return s->intra_sum;
+        default:
+                return s->intra_sum + s->cross_min;
+        }
+}
+
+#endif
@@ -0,0 +1,227 @@
+/**
+ * Representative items of every cluster id.
+ *
+ * Fixed cap (固定式代表點): a C x k slab with stride k = min(n, FIXED_REPS),
+ * reps of id i at pool[i * k].
+ *
+ * sqrt cap (變動式代表點): an offset-indexed pool.  Every id owns a block
+ * pool[off[i] .. off[i] + cap[i]); a singleton starts with one slot.  When a
+ * merge needs more reps than best_a owns, it takes best_b's block if that is
+ * large enough, else a free block at least that large, else a new block
+ * from the end of the pool, which grows by doubling.  Offsets stay valid
+ * across the realloc.
+ *
+ * The blocks a merge leaves behind (best_b's, and best_a's old one if it
+ * moved) go on a free list by capacity.  A block is numbered when it is
+ * made, the singletons' 0 .. n-1 and then one per merge at most, so there
+ * are never more than 2n of them and the lists link block numbers.
+ *
+ * Next to the item ids every block keeps the coordinates of its reps,
+ * attribute-major: attribute t of rep r at coord[t * ld + r], where ld is
+ * the block capacity (rep_ld).  link_dist reads them with SIMD loads
+ * instead of gathering from item_distances.
+ */
+
+#ifndef REPSLAB_H
+#define REPSLAB_H
+
+#include <stdlib.h>
+
+typedef struct repslab_s repslab;
+struct repslab_s {
+        int stride;    /* > 0: fixed-stride slab; 0: offset pool */
+        int dims;      /* attributes per rep */
+        int *pool;
+        float *coord;  /* dims floats per pool entry */
+        size_t *off;   /* pool only */
+        int *cap;
+        size_t used;
+        size_t size;
+
+        /* pool only: the free blocks */
+        int *block;             /* by id: the block it owns */
+        size_t *block_off;      /* by block: where it starts */
+        int *free_next;         /* by block: next free one of its cap */
+        int *free_head;         /* by cap 1 .. n: first free block, -1 */
+        int num_blocks;
+        int max_free_cap;       /* no free block is larger */
+};
+
+static inline int *rep_slot(const repslab *r, int id)
+{
+        if (r->stride)
+                return r->pool + (size_t)id * r->stride;
+        return r->pool + r->off[id];
+}
+
+static inline int rep_ld(const repslab *r, int id)
+{
+        return r->stride ? r->stride : r->cap[id];
+}
+
+static inline float *rep_coords(const repslab *r, int id)
+{
+        if (r->stride)
+                return r->coord + (size_t)id * r->stride * r->dims;
+        return r->coord + r->off[id] * r->dims;
+}
+
+// every id i starts as the singleton {i}; the caller fills its coords
+static inline int repslab_alloc(repslab *r, int n, int stride, int dims)
+{
+        int i;
+
+        r->stride = stride;
+        r->dims = dims;
+        r->off = NULL;
+        r->cap = NULL;
+        r->block = r->free_next = r->free_head = NULL;
+        r->block_off = NULL;
+        r->num_blocks = r->max_free_cap = 0;
+        if (stride) {
+                r->size = r->used = (size_t)n * stride;
+                r->pool = (int *)malloc((r->size ? r->size : 1) * sizeof(int));
+                r->coord = (float *)malloc((r->size ? r->size : 1) * dims
+                                           * sizeof(float));
+                if (!r->pool || !r->coord)
+                        return -1;
+        } else {
+                r->used = n;
+                r->size = 2 * (size_t)n;
+                r->pool = (int *)malloc((r->size ? r->size : 1) * sizeof(int));
+                r->coord = (float *)malloc((r->size ? r->size : 1) * dims
+                                           * sizeof(float));
+                r->off = (size_t *)malloc((n ? n : 1) * sizeof(size_t));
+                r->cap = (int *)malloc((n ? n : 1) * sizeof(int));
+                r->block = (int *)malloc((n ? n : 1) * sizeof(int));
+                r->block_off = (size_t *)malloc((n ? 2 * n : 1)
+                                                * sizeof(size_t));
+                r->free_next = (int *)malloc((n ? 2 * n : 1) * sizeof(int));
+                r->free_head = (int *)malloc((n + 1) * sizeof(int));
+                if (!r->pool || !r->coord || !r->off || !r->cap || !r->block
+                    || !r->block_off || !r->free_next || !r->free_head)
+                        return -1;
+                for (i = 0; i < n; i++) {
+                        r->off[i] = i;
+                        r->cap[i] = 1;
+                        r->block[i] = i;
+                        r->block_off[i] = i;
+                }
+                for (i = 0; i <= n; i++)
+                        r->free_head[i] = -1;
+                r->num_blocks = n;
+        }
+        for (i = 0; i < n; i++)
+                rep_slot(r, i)[0] = i;
+        return 0;
+}
+
+static inline void repslab_free(repslab *r)
+{
+        free(r->pool);
+        free(r->coord);
+        free(r->off);
+        free(r->cap);
+        free(r->block);
+        free(r->block_off);
+        free(r->free_next);
+        free(r->free_head);
+        r->pool = r->cap = NULL;
+        r->block = r->free_next = r->free_head = NULL;
+        r->coord = NULL;
+        r->off = r->block_off = NULL;
+        r->used = r->size = 0;
+}
+
+// block b of c slots goes on the free list
+static inline void repslab_free_block(repslab *r, int b, int c)
+{
+        if (c == 0)
+                return;
+        r->free_next[b] = r->free_head[c];
+        r->free_head[c] = b;
+        if (c > r->max_free_cap)
+                r->max_free_cap = c;
+}
+
+// id's block goes on the free list; id owns nothing after
+static inline void repslab_release(repslab *r, int id)
+{
+        repslab_free_block(r, r->block[id], r->cap[id]);
+        r->cap[id] = 0;
+}
+
+// a free block of at least k slots for id, the smallest there is; -1 if
+// there is none
+static inline int repslab_reuse(repslab *r, int id, int k)
+{
+        int b, c;
+
+        for (c = k; c <= r->max_free_cap; c++) {
+                b = r->free_head[c];
+                if (b < 0)
+                        continue;
+                r->free_head[c] = r->free_next[b];
+                // the bound stays tight, or every miss walks the empty
+                // lists up to a size long gone
+                while (r->max_free_cap > 0
+                       && r->free_head[r->max_free_cap] < 0)
+                        r->max_free_cap--;
+                r->block[id] = b;
+                r->off[id] = r->block_off[b];
+                r->cap[id] = c;
+                return 0;
+        }
+        return -1;
+}
+
+// make room for k reps of best_a; best_b is merged away and its block is
+// free to take.  The reps of both are in e->rep by now, so the blocks left
+// over can be handed out again at once.
+static inline int repslab_reserve(repslab *r, int best_a, int best_b, int k)
+{
+        size_t size;
+        int *pool, old_block, old_cap;
+        float *coord;
+
+        if (r->stride)
+                return 0;
+        if (r->cap[best_a] >= k) {
+                repslab_release(r, best_b);
+                return 0;
+        }
+        old_block = r->block[best_a];
+        old_cap = r->cap[best_a];
+        if (r->cap[best_b] >= k) {
+                r->block[best_a] = r->block[best_b];
+                r->off[best_a] = r->off[best_b];
+                r->cap[best_a] = r->cap[best_b];
+                r->cap[best_b] = 0;
+        } else if (repslab_reuse(r, best_a, k) != 0) {
+                if (r->used + k > r->size) {
+                        size = 2 * r->size;
+                        if (size < r->used + k)
+                                size = r->used + k;
+                        pool = (int *)realloc(r->pool, size * sizeof(int));
+                        if (!pool)
+                                return -1;
+                        r->pool = pool;
+                        coord = (float *)realloc(r->coord, size * r->dims
+                                                 * sizeof(float));
+                        if (!coord)
+                                return -1;
+                        r->coord = coord;
+                        r->size = size;
+                }
+                r->block[best_a] = r->num_blocks;
+                r->block_off[r->num_blocks++] = r->used;
+                r->off[best_a] = r->used;
+                r->cap[best_a] = k;
+                r->used += k;
+        }
+        repslab_release(r, best_b);
+        repslab_free_block(r, old_block, old_cap);
+        return 0;
+}
+
+#endif
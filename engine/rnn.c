@@ -0,0 +1,453 @@
+/**
+ * Reciprocal-nearest-neighbour rounds for the single-link variants (-m rnn).
+ *
+ * With a reducible linkage, link(A+B, X) >= min(link(A, X), link(B, X)),
+ * two clusters that are each other's nearest neighbour are merged by the
+ * one-pair-at-a-time loop sooner or later at their present dist, so every
+ * reciprocal pair can be merged in the same round.  The nearest neighbour
+ * nn[i] of every live cluster is kept over all live j (ties to the smaller
+ * id), with the clusters that have j as nearest in a list of j's, so a
+ * merge only visits the clusters whose nearest was A or B, and those tied
+ * at their nearest dist (tied[], kept in a list as well).  The ones it
+ * moves are scanned again together, on the pool, after the round.
+ *
+ * The pairs of a round are disjoint and choose() only reads the reps of
+ * the two clusters, so it runs for a batch of pairs at once on the pool;
+ * the merges themselves then go one pair after the other, in the round's
+ * order, with the reps it picked.
+ *
+ * No link row is computed for the merged cluster.  Its nearest neighbour,
+ * and every scan after a round, come from a kd-tree over the reps of all
+ * live clusters (kdtree.c): every rep of the cluster asks for the closest
+ * rep of another one, which is the single link by definition.  The tree
+ * is built once from the singletons and follows the merges, dropping the
+ * reps choose() leaves out and moving B's survivors to A.  Since the reps
+ * of A+B are a subset of those of A and B, the only other X that can take
+ * A+B as nearest had B at exactly its nearest dist, behind the nearest by
+ * id; the scans remember whether such a tie exists (tied[x]) and only
+ * those X get their link to A+B computed.
+ *
+ * Rounds go all the way to one cluster and record every merge.  The merge
+ * heights never decrease along a branch, so the first n - k merges in
+ * height order are the ones the one-pair-at-a-time loop does to reach k
+ * clusters; cut_merges rebuilds the item lists from those.
+ *
+ * That is checked as the rounds go.  Merges at equal heights on one
+ * branch are refused as well: the one-pair loop may take them in another
+ * order, and with the rep cap the order changes which reps survive.  In
+ * either case rnn_run gives up and engine_run starts over from the
+ * singletons with the one-pair loop.
+ *
+ * A merge here keeps the smaller id, which is not always the cluster the
+ * original programs kept (the lower place in nodes[]), so -m rnn gives the
+ * roles by id all along (e->by_id): the one-pair loop after rounds that
+ * gave up goes by id too.  That is not the loop of -m matrix, which goes
+ * by place, and under the rep cap the two can keep other reps.
+ */
+
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clust.h"
+#include "policy.h"
+
+/* fewer clusters than this to scan again and a round stays on one thread */
+#define PARALLEL_MIN_SCAN 64
+/* nor fewer pairs than this to choose the reps of */
+#define PARALLEL_MIN_MERGES 16
+/* reps chosen ahead for a batch of pairs, at most */
+#define CHOOSE_BATCH_REPS (1 << 16)
+/* slices of a batch for every thread, each with its own choose() scratch */
+#define SLICES_PER_THREAD 4
+
+struct rnn_s {
+        engine_t *e;
+        dist_rec *nn;          /* nearest live cluster of every live id */
+        char *tied;            /* another live j may be as near as nn[i] */
+        char *stale;           /* nn[i] was merged this round */
+        int *rescan;           /* ids to scan again after the round */
+        int num_rescan;
+        int *nn_head;          /* first id whose nearest is j, -1: none */
+        int *nn_next;          /* next id with the same nearest, */
+        int *nn_prev;          /* and the one before it */
+        int *ties;             /* ids that were tied[] when listed, once */
+        char *listed;          /* in ties[] */
+        int num_ties;
+        int *moved;            /* ids a merge visits, from the lists */
+        kdtree tree;           /* reps of the live clusters */
+        int *old;              /* reps of A and B before their merge */
+        const int *pairs;      /* the batch of pairs choose() runs for */
+        int num_pairs;
+        int *chosen;           /* and its reps, cap for every pair */
+        int *num_chosen;
+        scratch *slice;        /* choose() space of the slices of a batch */
+        int num_slices;
+        int cap;               /* reps of a cluster, at most */
+        int batch;             /* pairs in a batch */
+};
+
+// offer j at dist as the nearest neighbour of i, ties to the smaller id
+static inline void nn_offer(struct rnn_s *r, int i, float dist, int j)
+{
+        dist_rec *nn = &r->nn[i];
+
+        if (dist < nn->dist) {
+                nn->index = j;
+                nn->dist = dist;
+                r->tied[i] = 0;
+        } else if (dist == nn->dist) {
+                if (j < nn->index)
+                        nn->index = j;
+                r->tied[i] = 1;
+        }
+}
+
+// put i in the list of its nearest, and in ties[] if it is tied
+static void nn_link(struct rnn_s *r, int i)
+{
+        int j = r->nn[i].index;
+
+        if (r->tied[i] && !r->listed[i]) {
+                r->listed[i] = 1;
+                r->ties[r->num_ties++] = i;
+        }
+        if (j < 0)
+                return;
+        r->nn_prev[i] = -1;
+        r->nn_next[i] = r->nn_head[j];
+        if (r->nn_head[j] >= 0)
+                r->nn_prev[r->nn_head[j]] = i;
+        r->nn_head[j] = i;
+}
+
+// take i out of the list of its nearest
+static void nn_unlink(struct rnn_s *r, int i)
+{
+        int j = r->nn[i].index;
+
+        if (j < 0)
+                return;
+        if (r->nn_prev[i] >= 0)
+                r->nn_next[r->nn_prev[i]] = r->nn_next[i];
+        else
+                r->nn_head[j] = r->nn_next[i];
+        if (r->nn_next[i] >= 0)
+                r->nn_prev[r->nn_next[i]] = r->nn_prev[i];
+}
+
+// j is now the nearest of i, at the same dist
+static void nn_move(struct rnn_s *r, int i, int j)
+{
+        nn_unlink(r, i);
+        r->nn[i].index = j;
+        nn_link(r, i);
+}
+
+// single link of two live clusters from all their rep pairs
+static float pair_link(const engine_t *e, int i, int j)
+{
+        float mindist, maxdist;
+
+        e->kern->rep_minmax(rep_coords(&e->reps, i), rep_ld(&e->reps, i),
+                            rep_count(e->nodes_[i].num_items, e->policy.rep),
+                            rep_coords(&e->reps, j), rep_ld(&e->reps, j),
+                            rep_count(e->nodes_[j].num_items, e->policy.rep),
+                            &mindist, &maxdist);
+        return mindist;
+}
+
+// closest rep of another live cluster to any rep of i
+static void nn_scan(struct rnn_s *r, int i)
+{
+        const engine_t *e = r->e;
+        const float *coords = rep_coords(&e->reps, i);
+        int k = rep_count(e->nodes_[i].num_items, e->policy.rep);
+        int ld = rep_ld(&e->reps, i), rp, t;
+        float q[NUM_ATTRS];
+        kd_hit best = { FLT_MAX, -1, -1, 0 };
+
+        for (rp = 0; rp < k; rp++) {
+                for (t = 0; t < NUM_ATTRS; t++)
+                        q[t] = coords[t * ld + rp];
+                kd_nearest(&r->tree, q, i, &best);
+        }
+        r->nn[i].index = best.owner;
+        r->nn[i].dist = best.dist;
+        r->tied[i] = best.tied;
+}
+
+static void rescan_range(void *ctx, int begin, int end)
+{
+        struct rnn_s *r = ctx;
+        int idx;
+
+        for (idx = begin; idx < end; idx++)
+                nn_scan(r, r->rescan[idx]);
+}
+
+// nearest neighbours from the rows engine_init left
+static void nn_init(struct rnn_s *r)
+{
+        const engine_t *e = r->e;
+        int i, j, n = e->num_items;
+        const float *row;
+
+        trimat_advise(&e->clu_distances, TRI_SWEEP);
+        for (i = 0; i < n; i++) {
+                r->nn[i].index = -1;
+                r->nn[i].dist = FLT_MAX;
+                r->tied[i] = 0;
+                r->nn_head[i] = -1;
+        }
+        for (i = 0; i < n; i++) {
+                row = tri_row(&e->clu_distances, i);
+                for (j = i + 1; j < n; j++) {
+                        nn_offer(r, i, row[j - i - 1], j);
+                        nn_offer(r, j, row[j - i - 1], i);
+                }
+        }
+        for (i = 0; i < n; i++)
+                nn_link(r, i);
+}
+
+// the reps of pairs begin .. end - 1 of the batch, with s to work in
+static void choose_pairs(struct rnn_s *r, int begin, int end, scratch *s)
+{
+        int p;
+
+        for (p = begin; p < end; p++)
+                r->num_chosen[p] = r->e->choose(r->e, r->pairs[2 * p],
+                                                r->pairs[2 * p + 1],
+                                                r->chosen + (size_t)p * r->cap,
+                                                s);
+}
+
+// slices begin .. end - 1 of the batch; no two threads share a scratch
+static void choose_slices(void *ctx, int begin, int end)
+{
+        struct rnn_s *r = ctx;
+        int i;
+
+        for (i = begin; i < end; i++)
+                choose_pairs(r, (int)((long long)r->num_pairs * i
+                                      / r->num_slices),
+                             (int)((long long)r->num_pairs * (i + 1)
+                                   / r->num_slices),
+                             &r->slice[i]);
+}
+
+// nn[x] is scanned again after the round
+static void nn_stale(struct rnn_s *r, int x)
+{
+        r->stale[x] = 1;
+        r->rescan[r->num_rescan++] = x;
+}
+
+// merge a reciprocal pair with the reps chosen for it and move the
+// nearest neighbours it affects
+static void rnn_merge(struct rnn_s *r, int a, int b, const int *rep,
+                      int num_reps)
+{
+        engine_t *e = r->e;
+        dist_rec *nn;
+        int idx, x, num;
+
+        merge_followed(e, &r->tree, r->old, a, b, rep, num_reps);
+        release_ext(e, b);
+        // a is scanned with the others after the round, b is gone
+        nn_unlink(r, a);
+        nn_unlink(r, b);
+        r->nn[a].index = r->nn[b].index = -1;
+        nn_stale(r, a);
+
+        // the ones whose nearest was a or b, gathered first as moving them
+        // changes the lists
+        num = 0;
+        for (x = r->nn_head[a]; x >= 0; x = r->nn_next[x])
+                r->moved[num++] = x;
+        for (x = r->nn_head[b]; x >= 0; x = r->nn_next[x])
+                r->moved[num++] = x;
+        for (idx = 0; idx < num; idx++) {
+                x = r->moved[idx];
+                // a stale nn[x] is scanned again after the round anyway
+                if (r->stale[x])
+                        continue;
+                if (pair_link(e, x, a) == r->nn[x].dist)
+                        // the merged cluster kept the rep pair: still the
+                        // nearest, and the smallest id at that dist
+                        nn_move(r, x, a);
+                else
+                        nn_stale(r, x);
+        }
+        // b at the nearest dist of x, behind its nearest by id, and a
+        // before it: a may have kept that rep of b
+        for (idx = num = 0; idx < r->num_ties; idx++) {
+                x = r->ties[idx];
+                if (!r->tied[x] || e->nodes_[x].num_items == 0) {
+                        r->listed[x] = 0;
+                        continue;
+                }
+                r->ties[num++] = x;
+                nn = &r->nn[x];
+                if (!r->stale[x] && a < nn->index && nn->index < b
+                    && pair_link(e, x, a) == nn->dist)
+                        nn_move(r, x, a);
+        }
+        r->num_ties = num;
+}
+
+// one round: merge every reciprocal pair, then scan again the clusters
+// whose nearest was merged; -1 if a check fails
+static int rnn_round(struct rnn_s *r, int *pairs, float *height,
+                     merge_rec *merges, int *num_merges)
+{
+        engine_t *e = r->e;
+        int i, j, a, b, p, first, num_pairs = 0, num;
+        float dist;
+
+        for (i = e->first_live; i >= 0; i = e->next_live[i]) {
+                j = r->nn[i].index;
+                if (j > i && r->nn[j].index == i) {
+                        pairs[2 * num_pairs] = i;
+                        pairs[2 * num_pairs + 1] = j;
+                        num_pairs++;
+                }
+        }
+        // the closest pair is always reciprocal
+        if (num_pairs == 0)
+                return -1;
+
+        r->num_rescan = 0;
+        for (first = 0; first < num_pairs; first += r->batch) {
+                num = num_pairs - first < r->batch ? num_pairs - first
+                                                   : r->batch;
+                r->pairs = pairs + 2 * first;
+                r->num_pairs = num;
+                if (r->slice && num >= PARALLEL_MIN_MERGES)
+                        pool_run(e->pool, choose_slices, r, r->num_slices);
+                else
+                        choose_pairs(r, 0, num, &e->scratch);
+                for (p = 0; p < num; p++) {
+                        a = r->pairs[2 * p];
+                        b = r->pairs[2 * p + 1];
+                        // a tie with a cluster merged earlier in the round
+                        // can take a or b; its reps chosen go unused
+                        if (r->nn[a].index != b || r->nn[b].index != a)
+                                continue;
+                        dist = r->nn[a].dist;
+                        if (dist <= height[a] || dist <= height[b])
+                                return -1;
+                        merges[*num_merges].a = a;
+                        merges[*num_merges].b = b;
+                        merges[*num_merges].seq = *num_merges;
+                        merges[*num_merges].dist = dist;
+                        (*num_merges)++;
+                        height[a] = dist;
+                        rnn_merge(r, a, b, r->chosen + (size_t)p * r->cap,
+                                  r->num_chosen[p]);
+                }
+        }
+
+        for (i = num = 0; i < r->num_rescan; i++) {
+                j = r->rescan[i];
+                r->stale[j] = 0;
+                nn_unlink(r, j);
+                if (e->nodes_[j].num_items > 0)
+                        r->rescan[num++] = j;
+        }
+        r->num_rescan = num;
+        // most of the singletons' slots are dead after a few rounds
+        if (r->tree.num_nodes > 0
+            && 2 * r->tree.node[0].num_live < r->tree.num
+            && kd_compact(&r->tree, &e->cols) != 0) {
+                alloc_fail("kd-tree");
+                exit(1);
+        }
+        if (e->pool && num >= PARALLEL_MIN_SCAN)
+                pool_run(e->pool, rescan_range, r, num);
+        else
+                rescan_range(r, 0, num);
+        for (i = 0; i < num; i++)
+                nn_link(r, r->rescan[i]);
+        return 0;
+}
+
+int rnn_run(engine_t *e, int num_clusters)
+{
+        struct rnn_s r;
+        merge_rec *merges;
+        float *height;
+        int *pairs, i, num_merges = 0, status = 0, n = e->num_items;
+
+        if (e->num_clusters_remaining <= num_clusters)
+                return 0;
+        memset(&r, 0, sizeof(r));
+        r.e = e;
+        r.cap = rep_count(n, e->policy.rep);
+        r.batch = CHOOSE_BATCH_REPS / r.cap > 0 ? CHOOSE_BATCH_REPS / r.cap
+                                                : 1;
+        if (r.batch > n / 2 + 1)
+                r.batch = n / 2 + 1;
+        r.nn = alloc_mem(n, dist_rec);
+        r.tied = alloc_mem(n, char);
+        r.stale = alloc_mem(n, char);
+        r.rescan = alloc_mem(n, int);
+        r.nn_head = alloc_mem(n, int);
+        r.nn_next = alloc_mem(n, int);
+        r.nn_prev = alloc_mem(n, int);
+        r.ties = alloc_mem(n, int);
+        r.listed = alloc_mem(n, char);
+        r.moved = alloc_mem(n, int);
+        r.old = alloc_mem(n, int);
+        r.chosen = alloc_mem((size_t)r.batch * r.cap, int);
+        r.num_chosen = alloc_mem(r.batch, int);
+        if (e->pool) {
+                r.num_slices = SLICES_PER_THREAD * e->num_threads;
+                r.slice = alloc_mem(r.num_slices, scratch);
+        }
+        merges = alloc_mem(n, merge_rec);
+        height = alloc_mem(n, float);
+        pairs = alloc_mem(n, int);
+        // every item is its own cluster and rep yet, below any merge
+        for (i = 0; pairs && height && i < n; i++) {
+                pairs[i] = i;
+                height[i] = -1.0f;
+        }
+        if (!r.nn || !r.tied || !r.stale || !r.rescan || !r.nn_head
+            || !r.nn_next || !r.nn_prev || !r.ties || !r.listed || !r.moved
+            || !r.old || !r.chosen || !r.num_chosen
+            || (e->pool && !r.slice) || !merges || !height
+            || !pairs || kd_build(&r.tree, &e->cols, pairs, pairs, n) != 0) {
+                alloc_fail("reciprocal pairs");
+                status = -1;
+        } else {
+                nn_init(&r);
+                while (status == 0 && e->num_clusters_remaining > 1)
+                        status = rnn_round(&r, pairs, height, merges,
+                                           &num_merges);
+                if (status == 0)
+                        cut_merges(e, merges, num_merges, num_clusters);
+        }
+        free(r.nn);
+        free(r.tied);
+        free(r.stale);
+        free(r.rescan);
+        free(r.nn_head);
+        free(r.nn_next);
+        free(r.nn_prev);
+        free(r.ties);
+        free(r.listed);
+        free(r.moved);
+        free(r.old);
+        free(r.chosen);
+        free(r.num_chosen);
+        for (i = 0; i < r.num_slices && r.slice; i++)
+                free(r.slice[i].p);
+        free(r.slice);
+        kd_free(&r.tree);
+        free(merges);
+        free(height);
+        free(pairs);
+        return status;
+}
@@ -0,0 +1,68 @@
+/**
+ * Blocked item_distances builder for wide items (NUM_ATTRS >= TILE_MIN_ATTRS).
+ *
+ * dist_row streams every column of the items j past one item i, which for
+ * wide items is out of cache again by the next row.  Here a panel of
+ * BLOCK_COLS items j, cut into BLOCK_ATTRS-attribute slices, is reused by
+ * BLOCK_ROWS items i at a time, TILE_ROWS rows per register tile
+ * (diff_tile in kernels.c).
+ *
+ * Each dist is still the sum of (x_i - x_j)^2 over the attributes in
+ * order, the slices one after the other into the same float, so it is
+ * the dist dist_row and link_dist compute, to the bit.
+ */
+
+#include <string.h>
+
+#include "clust.h"
+
+#define BLOCK_ROWS 64
+#define BLOCK_COLS 128
+#define BLOCK_ATTRS 64
+
+// rows i0 .. i1-1 against items j0 .. j1-1, written where j > i
+static void tile_block(engine_t *e, int i0, int i1, int j0, int j1,
+                       float *acc)
+{
+        const item_cols *c = &e->cols;
+        int i, j, r, t0, t1;
+
+        memset(acc, 0, (size_t)(i1 - i0) * BLOCK_COLS * sizeof(float));
+        for (t0 = 0; t0 < NUM_ATTRS; t0 = t1) {
+                t1 = t0 + BLOCK_ATTRS < NUM_ATTRS ? t0 + BLOCK_ATTRS : NUM_ATTRS;
+                for (r = i0; r < i1; r += TILE_ROWS)
+                        e->kern->diff_tile(c, r, i1 - r < TILE_ROWS ? i1 - r : TILE_ROWS,
+                                           j0, j1, t0, t1,
+                                           acc + (size_t)(r - i0) * BLOCK_COLS,
+                                           BLOCK_COLS);
+        }
+        for (i = i0; i < i1; i++) {
+                j = j0 > i + 1 ? j0 : i + 1;
+                memcpy(tri_row(&e->item_distances, i) + (j - i - 1),
+                       acc + (size_t)(i - i0) * BLOCK_COLS + j - j0,
+                       (size_t)(j1 - j) * sizeof(float));
+        }
+}
+
+// rows begin .. end-1 of item_distances
+void tile_dist_rows(engine_t *e, int begin, int end)
+{
+        int i0, i1, j0, j1, n = e->num_items;
+        float *acc = alloc_mem((size_t)BLOCK_ROWS * BLOCK_COLS, float);
+
+        if (!acc) {
+                alloc_fail("distance tile");
+                exit(1);
+        }
+        for (j0 = begin + 1; j0 < n; j0 += BLOCK_COLS) {
+                j1 = j0 + BLOCK_COLS < n ? j0 + BLOCK_COLS : n;
+                // only rows with some j > i inside this panel
+                for (i0 = begin; i0 < end && i0 < j1 - 1; i0 = i1) {
+                        i1 = i0 + BLOCK_ROWS < end ? i0 + BLOCK_ROWS : end;
+                        if (i1 > j1 - 1)
+                                i1 = j1 - 1;
+                        tile_block(e, i0, i1, j0, j1, acc);
+                }
+        }
+        free(acc);
+}
@@ -0,0 +1,180 @@
+/**
+ * Storage of the packed triangles: malloc'd chunks of whole rows, or a
+ * file for matrices that do not fit in memory.
+ *
+ * trimat_map makes an unlinked file under dir with room for all the rows,
+ * reserved up front so that a full disk fails here and not with SIGBUS
+ * halfway through a run, and maps it shared: the kernel writes the dirty
+ * rows back and drops them as memory runs short, and the engine goes on
+ * at the speed of the disk.  The layout is the one trimat.h uses in
+ * memory, so tri_row and friends work on it unchanged.
+ *
+ * The engine reads and writes the matrices in row order (init_rows, the
+ * rescans, eval.c) or a cell per row in increasing row order (the column
+ * half of link_dist); trimat_advise tells the kernel which of the two is
+ * coming, and trimat_prefetch starts reading a row about to be swept.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "trimat.h"
+
+// the row table of rows begin .. end-1 laid out one after the other from p
+static void fill_rows(trimat *m, int begin, int end, float *p)
+{
+        int i;
+
+        for (i = begin; i < end; i++) {
+                m->row[i] = p;
+                p += m->n - 1 - i;
+        }
+}
+
+// row table and chunk list for n rows, nothing in them yet
+static int trimat_init(trimat *m, int n, int num_chunks)
+{
+        m->n = n;
+        m->mapped = 0;
+        m->num_chunks = 0;
+        m->row = (float **)malloc((n > 0 ? n : 1) * sizeof(float *));
+        m->chunk = (float **)calloc(num_chunks, sizeof(float *));
+        if (!m->row || !m->chunk) {
+                trimat_free(m);
+                return -1;
+        }
+        return 0;
+}
+
+int trimat_alloc(trimat *m, int n)
+{
+        size_t max = TRI_CHUNK_BYTES / sizeof(float), len;
+        int i, begin, num_chunks = 1;
+
+        // whole rows per chunk, at least one even if it is longer
+        for (i = 0, len = 0; i < n - 1; len += n - 1 - i, i++)
+                if (len > 0 && len + (n - 1 - i) > max) {
+                        num_chunks++;
+                        len = 0;
+                }
+        if (trimat_init(m, n, num_chunks) != 0)
+                return -1;
+        for (begin = 0; m->num_chunks < num_chunks; begin = i) {
+                for (i = begin, len = 0; i < n - 1; len += n - 1 - i, i++)
+                        if (len > 0 && len + (n - 1 - i) > max)
+                                break;
+                m->chunk[m->num_chunks] =
+                        (float *)malloc((len > 0 ? len : 1) * sizeof(float));
+                if (!m->chunk[m->num_chunks]) {
+                        trimat_free(m);
+                        return -1;
+                }
+                // the last row is empty, but has its place in the table
+                fill_rows(m, begin, i < n - 1 ? i : n,
+                          m->chunk[m->num_chunks++]);
+        }
+        return 0;
+}
+
+int trimat_map(trimat *m, int n, const char *dir)
+{
+        size_t bytes = tri_size(n) * sizeof(float);
+        char path[4096];
+        void *p;
+        int fd, err;
+
+        if (trimat_init(m, n, 1) != 0)
+                return -1;
+        if (snprintf(path, sizeof(path), "%s/clust-XXXXXX", dir)
+            >= (int)sizeof(path)) {
+                trimat_free(m);
+                return -1;
+        }
+        fd = mkstemp(path);
+        if (fd < 0) {
+                fprintf(stderr, "Failed to create a matrix file in %s: %s\n",
+                        dir, strerror(errno));
+                trimat_free(m);
+                return -1;
+        }
+        // gone from the directory now, and from the disk with the mapping
+        unlink(path);
+        err = posix_fallocate(fd, 0, (off_t)bytes);
+        if (err != 0) {
+                fprintf(stderr, "Failed to reserve %zu bytes in %s: %s\n",
+                        bytes, dir, strerror(err));
+                close(fd);
+                trimat_free(m);
+                return -1;
+        }
+        p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+                trimat_free(m);
+                return -1;
+        }
+        m->chunk[0] = p;
+        m->num_chunks = 1;
+        m->mapped = bytes;
+        fill_rows(m, 0, n, p);
+        // engine_init writes it row after row
+        trimat_advise(m, TRI_SWEEP);
+        return 0;
+}
+
+void trimat_advise(const trimat *m, tri_use use)
+{
+        if (!m->mapped)
+                return;
+        switch (use) {
+        case TRI_SWEEP:
+                madvise(m->chunk[0], m->mapped, MADV_SEQUENTIAL);
+                break;
+        case TRI_SCATTER:
+                madvise(m->chunk[0], m->mapped, MADV_RANDOM);
+                break;
+        case TRI_IDLE:
+                madvise(m->chunk[0], m->mapped, MADV_NORMAL);
+#ifdef MADV_PAGEOUT
+                madvise(m->chunk[0], m->mapped, MADV_PAGEOUT);
+#endif
+                break;
+        }
+}
+
+// read row i in ahead of a sweep over it
+void trimat_prefetch(const trimat *m, int i)
+{
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        uintptr_t begin, end;
+
+        if (!m->mapped || i >= m->n - 1)
+                return;
+        begin = (uintptr_t)tri_row(m, i);
+        end = begin + (size_t)(m->n - 1 - i) * sizeof(float);
+        begin &= ~(uintptr_t)(page - 1);
+        madvise((void *)begin, end - begin, MADV_WILLNEED);
+}
+
+void trimat_free(trimat *m)
+{
+        int c;
+
+        if (m->mapped)
+                munmap(m->chunk[0], m->mapped);
+        else
+                for (c = 0; c < m->num_chunks; c++)
+                        free(m->chunk[c]);
+        free(m->chunk);
+        free(m->row);
+        m->row = m->chunk = NULL;
+        m->num_chunks = 0;
+        m->n = 0;
+        m->mapped = 0;
+}
@@ -0,0 +1,76 @@
+/**
+ * Condensed upper-triangular matrix: only the i < j half of an n * n
+ * symmetric matrix, row after row, n(n-1)/2 floats.
+ *
+ *   row 0: (0,1) (0,2) ... (0,n-1)
+ *   row 1: (1,2) ... (1,n-1)
+ *   ...
+ *
+ * Past a few ten thousand items that is more than one malloc should be
+ * asked for, so trimat_alloc cuts the rows into chunks of whole rows of at
+ * most TRI_CHUNK_BYTES each, and row[i] finds row i in its chunk.  For
+ * matrices larger than memory, trimat_map puts all the rows in one file
+ * mapping in the same order instead (trimat.c).
+ */
+
+#ifndef TRIMAT_H
+#define TRIMAT_H
+
+#include <stdlib.h>
+
+#ifndef TRI_CHUNK_BYTES
+#define TRI_CHUNK_BYTES ((size_t)1 << 30)
+#endif
+
+typedef struct trimat_s trimat;
+struct trimat_s {
+        int n;
+        float **row;           /* row[i][j - i - 1] is (i, j) for j > i;
+                                  NULL if there is no matrix */
+        float **chunk;         /* allocations holding the rows */
+        int num_chunks;
+        size_t mapped;         /* bytes of the file mapping (chunk[0]),
+                                  0 if malloc'd */
+};
+
+/* how a mapped matrix is about to be used, for the kernel's paging */
+typedef enum {
+        TRI_SWEEP,      /* rows in order: read ahead, drop behind */
+        TRI_SCATTER,    /* single cells all over it: no read ahead */
+        TRI_IDLE        /* not needed for a while: may be written out */
+} tri_use;
+
+// row i from (i, i+1) on: row[j - i - 1] is (i, j) for j > i
+static inline float *tri_row(const trimat *m, int i)
+{
+        return m->row[i];
+}
+
+static inline float tri_get(const trimat *m, int i, int j)
+{
+        if (i < j)
+                return m->row[i][j - i - 1];
+        return m->row[j][i - j - 1];
+}
+
+static inline void tri_set(trimat *m, int i, int j, float v)
+{
+        if (i < j)
+                m->row[i][j - i - 1] = v;
+        else
+                m->row[j][i - j - 1] = v;
+}
+
+static inline size_t tri_size(int n)
+{
+        return n > 1 ? (size_t)n * (n - 1) / 2 : 1;
+}
+
+/* trimat.c */
+int trimat_alloc(trimat *m, int n);
+int trimat_map(trimat *m, int n, const char *dir);
+void trimat_advise(const trimat *m, tri_use use);
+void trimat_prefetch(const trimat *m, int i);
+void trimat_free(trimat *m);
+
+#endif